@@ -0,0 +1,90 @@
+/*
+
+  Copyright (C) 2023 Ángel Ruiz Fernandez
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+  arena.c: Per-game bump allocator over one contiguous block
+
+*/
+
+#include "arena.h"
+
+#ifdef __KERNEL__
+    #include <linux/slab.h>  /* kmalloc */
+    #define malloc(size)    kmalloc(size, GFP_KERNEL)
+    #define free            kfree
+#elif FRONTENDS_KERNEL
+    #include <stdint.h>
+    #include "../kernel_src/alloc.h"
+    #define malloc  kmalloc
+    #define free    kfree
+#else
+    #include <stdint.h>
+    #include <stdlib.h>
+#endif
+
+/* Reserve one block big enough for size bytes of aligned allocations */
+int
+arenaInit(arena_t *a, size_t size) {
+    a->size = ARENA_ALIGNED(size);
+    a->used = 0;
+
+    /* Slack so the base can be moved up to a cache line */
+    a->block = malloc(a->size + ARENA_ALIGN - 1);
+    if (a->block == NULL) {
+        a->base = NULL;
+        a->size = 0;
+        return -1;
+    }
+
+    a->base = (char*)ARENA_ALIGNED((uintptr_t)a->block);
+
+    return 0;
+}
+
+/* Use caller owned memory as the block, it is not freed on destroy */
+void
+arenaInitMem(arena_t *a, void *mem, size_t size) {
+    a->block = NULL;
+    a->base = (char*)ARENA_ALIGNED((uintptr_t)mem);
+    a->size = size - (a->base - (char*)mem);
+    a->size &= ~(size_t)(ARENA_ALIGN - 1);
+    a->used = 0;
+}
+
+/* Carve a cache line aligned block, NULL if the arena is exhausted */
+void *
+arenaAlloc(arena_t *a, size_t size) {
+    size = ARENA_ALIGNED(size);
+    if (a->base == NULL || size > a->size - a->used)
+        return NULL;
+
+    void *p = a->base + a->used;
+    a->used += size;
+    return p;
+}
+
+/* Drop every allocation but keep the block */
+void
+arenaReset(arena_t *a) {
+    a->used = 0;
+}
+
+void
+arenaDestroy(arena_t *a) {
+    free(a->block);
+    a->block = a->base = NULL;
+    a->size = a->used = 0;
+}
@@ -0,0 +1,47 @@
+/*
+
+  Copyright (C) 2023 Ángel Ruiz Fernandez
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#ifdef __KERNEL__
+    #include <linux/types.h>
+#else
+    #include <stddef.h>
+#endif
+
+/* Every allocation starts on a cache line */
+#define ARENA_ALIGN         64u
+
+/* Size a block takes in the arena, for sizing it up front */
+#define ARENA_ALIGNED(s)    (((s) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+typedef struct {
+    char *block;    /* as returned by malloc */
+    char *base;     /* first aligned byte */
+    size_t size, used;
+} arena_t;
+
+int arenaInit(arena_t *a, size_t size);
+void arenaInitMem(arena_t *a, void *mem, size_t size);
+void *arenaAlloc(arena_t *a, size_t size);
+void arenaReset(arena_t *a);
+void arenaDestroy(arena_t *a);
+
+#endif
@@ -30,6 +30,7 @@
 #define GL3_VS_PATH   "../assets/msboard.vs"
 #define GL3_FS_PATH   "../assets/msboard.fs"
 #define JAVA_CLASS_PATH "../assets/"
+#define BOT_SOCKET_PATH "/tmp/arfminesweeper.sock"
 
 #define HEADER_HEIGHT 60
 #define CELL_SIZE     20
@@ -20,33 +20,49 @@
 */
 
 #include "game.h"
+#include "arena.h"
 
 #ifdef __KERNEL__
     #include <linux/module.h>
     #include <linux/kernel.h>
-    #include <linux/slab.h>  /* kmalloc */
-    #define malloc(size)    kmalloc(size, GFP_KERNEL)
-    #define free            kfree
+    #include <asm/barrier.h>
+    #define WRITE_BARRIER() smp_wmb()
+    #define THREAD_LOCAL
 #elif FRONTENDS_KERNEL
     #include <stddef.h>
     #include <stdint.h>
-    #include "../kernel_src/alloc.h"
     #include "../kernel_src/random.h"
     #include "../kernel_src/plibc.h"
     #include "../kernel_src/rtc_time.h"
     #define rand    prng_rand
     #define srand   prng_srand
-    #define malloc  kmalloc
-    #define free    kfree
     #define time    rtc_time
+    /* Single core, only the compiler can reorder */
+    #define WRITE_BARRIER() __asm__ volatile ("" ::: "memory")
+    #define THREAD_LOCAL
 #else
     #include <stdlib.h>
     #include <time.h>
+    #ifdef _MSC_VER
+    #include <intrin.h>
+    #define WRITE_BARRIER() _ReadWriteBarrier()
+    #define THREAD_LOCAL    __declspec(thread)
+    #else
+    #define WRITE_BARRIER() __atomic_thread_fence(__ATOMIC_RELEASE)
+    #define THREAD_LOCAL    _Thread_local
+    #endif
 #endif
 
-static int *board = NULL;
+/* Game the API works on, the default one unless another is selected. Each
+    thread selects its own */
+static game_t defaultGame = { 0 };
+static THREAD_LOCAL game_t *g = &defaultGame;
+
+/* Settings shared by every game */
+static int safeFirstClick = 0, seeded = 0;
 
-static int size = 0, mines = 0, flagsLeft = 0, state = 0;
+/* Count plane access XY macro */
+#define COUNTXY(x, y)  counts[((y) * size) + (x)]
 
 #define FOREACH_SURROUNDING(x, y, a) \
     if (x > 0        && y > 0        && CHECK_MINE(BOARDXY(x - 1, y - 1))) a; \
@@ -58,15 +74,128 @@ static int size = 0, mines = 0, flagsLeft = 0, state = 0;
     if (                y < size - 1 && CHECK_MINE(BOARDXY(x    , y + 1))) a; \
     if (x < size - 1 && y < size - 1 && CHECK_MINE(BOARDXY(x + 1, y + 1))) a;
 
+/* Pick a random cell */
+static void
+randomCell(int *x, int *y) {
+    #ifndef __KERNEL__
+    *x = rand() % g->size;
+    *y = rand() % g->size;
+    #else
+    get_random_bytes(x, sizeof(*x));
+    get_random_bytes(y, sizeof(*y));
+    *x %= g->size;  *y %= g->size;
+    #endif
+}
+
+/* Mark the published state as being written, starting a new move */
+static void
+publishBegin(void) {
+    g->shared->seq = ++g->seq;
+    WRITE_BARRIER();
+    g->njournal = 0;
+}
+
+static void
+journalAdd(int i) {
+    if (g->njournal < g->journalSize)
+        g->journal[g->njournal] = i;
+    g->njournal++;
+}
+
+/* Publish the counters and mark the state consistent again */
+static void
+publishEnd(void) {
+    g->shared->state = g->state;
+    g->shared->flagsLeft = g->flagsLeft;
+    WRITE_BARRIER();
+    g->shared->seq = ++g->seq;
+}
+
+/* A move never changes more cells than the board has */
+static int
+journalSize(int lsize) {
+    return lsize * lsize < GAME_JOURNAL_SIZE ? lsize * lsize :
+        GAME_JOURNAL_SIZE;
+}
+
+/* Make game the one the API works on, NULL for the default one */
+void
+gameSelect(game_t *game) {
+    g = game ? game : &defaultGame;
+}
+
+game_t *
+gameSelected(void) {
+    return g;
+}
+
+/* Bytes of game memory a board of this size needs */
+size_t
+gameMemorySize(int lsize) {
+    return ARENA_ALIGNED(sizeof(game_shared_t)) +
+        ARENA_ALIGNED(sizeof(int) * lsize * lsize) +
+        ARENA_ALIGNED(lsize * lsize) +
+        ARENA_ALIGNED(sizeof(int) * journalSize(lsize));
+}
+
+/* Place the game memory in caller owned memory from the next gameInit on,
+    NULL to go back to allocating it */
+void
+gameSetMemory(void *mem, size_t msize) {
+    g->extMem = mem;
+    g->extSize = msize;
+}
+
+/* The previous game's pointers may lead into a block that is gone or too
+    small now, leave an empty game behind instead */
+static int
+initFailed(void) {
+    gameDestroy();
+    g->size = g->mines = 0;
+    g->journalSize = g->njournal = g->nspares = 0;
+    return -1;
+}
+
 /* Initialise the board */
 int
 gameInit(int lsize, int lmines) {
-    size = lsize;
-    mines = lmines;
-    flagsLeft = 10;
+    if (lsize < 1 || lsize > GAME_MAX_SIZE || lmines < 0 ||
+        lmines > lsize * lsize)
+            return -1;
+
+    g->size = lsize;
+    g->mines = lmines;
+    g->flagsLeft = 10;
     
-    /* Allocate square board */
-    board = malloc(sizeof(int) * size * size);
+    /* Reserve the arena for the header, board and count plane, reusing
+        the previous game's block if it is big enough */
+    size_t need = gameMemorySize(lsize);
+    if (g->extMem) {
+        arenaDestroy(&g->arena);
+        arenaInitMem(&g->arena, g->extMem, g->extSize);
+        if (g->arena.size < need)
+            return initFailed();
+    }
+    else if (g->arena.block && g->arena.size >= need)
+        arenaReset(&g->arena);
+    else {
+        arenaDestroy(&g->arena);
+        if (arenaInit(&g->arena, need) < 0)
+            return initFailed();
+    }
+
+    /* Header, square board, count plane and journal, in that order */
+    int size = lsize;
+    g->shared = arenaAlloc(&g->arena, sizeof(game_shared_t));
+    int *board = g->board = arenaAlloc(&g->arena, sizeof(int) * size * size);
+    unsigned char *counts = g->counts = arenaAlloc(&g->arena, size * size);
+    g->journalSize = journalSize(size);
+    g->journal = arenaAlloc(&g->arena, sizeof(int) * g->journalSize);
+    if (g->shared == NULL || board == NULL || counts == NULL ||
+        g->journal == NULL)
+            return initFailed();
+
+    publishBegin();
 
     /* Initialise clear */
     for (int i = 0; i < size * size; i++)
@@ -74,21 +203,18 @@ gameInit(int lsize, int lmines) {
 
     /* Add mines at random locations */
     /* Seed the rand(3) pseudorandom number generator with time(2), good
-        enough entropy */
+        enough entropy. Only once, games started within the same second
+        must not get the same board */
     #ifndef __KERNEL__
-    srand(time(NULL));
+    if (!seeded) {
+        srand(time(NULL));
+        seeded = 1;
+    }
     #endif
 
     int x = 0, y = 0, n = 0;
-    while (n < mines) {
-        #ifndef __KERNEL__
-        x = rand() % size;
-        y = rand() % size;
-        #else
-        get_random_bytes(&x, sizeof(x));
-        get_random_bytes(&y, sizeof(y));
-        x %= size;  y %= size;
-        #endif
+    while (n < g->mines) {
+        randomCell(&x, &y);
 
         /* If there is already a mine, regenerate location */
         if (CHECK_MINE(BOARDXY(x, y)))
@@ -100,108 +226,269 @@ gameInit(int lsize, int lmines) {
         n++;
     }
 
-    gameSetState(STATE_GOING);
+    /* Reserve distinct free cells for first click mine relocation */
+    g->nspares = size * size - g->mines;
+    if (g->nspares > GAME_SPARE_SLOTS) g->nspares = GAME_SPARE_SLOTS;
+    if (g->nspares < 0) g->nspares = 0;
+
+    n = 0;
+    while (n < g->nspares) {
+        randomCell(&x, &y);
+
+        if (CHECK_MINE(BOARDXY(x, y)))
+            continue;
+
+        int i = 0;
+        while (i < n && g->spares[i] != (y * size) + x) i++;
+        if (i < n)
+            continue;
+
+        g->spares[n++] = (y * size) + x;
+    }
+
+    g->started = 0;
+
+    /* Precompute the neighbor mine count of every cell */
+    for (y = 0; y < size; y++)
+        for (x = 0; x < size; x++) {
+            n = 0;
+            FOREACH_SURROUNDING(x, y, n++)
+            COUNTXY(x, y) = n;
+        }
+
+    g->shared->size = size;
+    g->shared->mines = g->mines;
+    g->shared->boardOffset = (char*)board - (char*)g->shared;
+    g->shared->countsOffset = (char*)counts - (char*)g->shared;
+
+    g->state = STATE_GOING;
+    publishEnd();
+    g->njournal = 0;
 
     return 0;
 }
 
 void
 gameDestroy() {
-    free(board);
+    arenaDestroy(&g->arena);
+    g->shared = NULL;
+    g->board = NULL;
+    g->counts = NULL;
+    g->journal = NULL;
 }
 
 const int * 
 gameGetBoard() {
-    return board;
+    return g->board;
 }
 
 int
 gameGetState() {
-    return state;
+    return g->state;
+}
+
+int
+gameGetMines() {
+    return g->mines;
 }
 
 void
 gameSetState(int s) {
-    state = s;
+    publishBegin();
+    g->state = s;
+    publishEnd();
+}
+
+/* Cells changed by the last move, NULL if there were too many to record
+    and the whole board has to be considered changed */
+const int *
+gameGetChanges(int *n) {
+    *n = g->njournal;
+    return g->njournal > g->journalSize ? NULL : g->journal;
+}
+
+/* Number of moves published so far, only ever grows */
+unsigned int
+gameGetVersion() {
+    return g->seq / 2;
 }
 
 int
 gameGetFlagsLeft() {
-    return flagsLeft;
+    return g->flagsLeft;
+}
+
+void
+gameSetSafeFirstClick(int enable) {
+    safeFirstClick = enable;
 }
 
 int
 gameGetSurroundingMines(int x, int y) {
-    int n = 0;
-    FOREACH_SURROUNDING(x, y, n++)
-    return n;
+    int size = g->size;
+    unsigned char *counts = g->counts;
+    return COUNTXY(x, y);
 }
 
 int
 checkWin(void) {
-    for (int i = 0; i < size * size; i++)
+    int *board = g->board;
+    for (int i = 0; i < g->size * g->size; i++)
         if ((!CHECK_CLEAR(board[i]) && !CHECK_MINE(board[i]))
             || (!CHECK_FLAG(board[i]) && CHECK_MINE(board[i]))) return 0;
     return 1;
 }
 
-/* Cell clearing recursive algorithm */
-void
-gameClearCell(int x, int y) {
+/* Cell clearing recursive algorithm, does not evaluate win */
+static void
+clearCell(int x, int y) {
+    int size = g->size, *board = g->board;
+    unsigned char *counts = g->counts;
+
     if (CHECK_CLEAR(BOARDXY(x, y)) || CHECK_FLAG(BOARDXY(x, y))) {
         return;
     }
     else if (CHECK_MINE(BOARDXY(x, y))) {
-        state = STATE_LOST;
+        g->state = STATE_LOST;
     } else {
         /* Set clear bit */
         BOARDXY(x, y) |= 1 << CELL_BIT_CLEAR;
+        journalAdd((y * size) + x);
 
         /* If no mine near, propagate surrounding cells */
-        if (gameGetSurroundingMines(x, y) == 0) {
+        if (COUNTXY(x, y) == 0) {
             if (x > 0 && y > 0 &&
                 !CHECK_CLEAR(BOARDXY(x - 1, y - 1)) &&
                 !CHECK_MINE(BOARDXY(x - 1, y - 1)))
-                    gameClearCell(x - 1, y - 1);
+                    clearCell(x - 1, y - 1);
             if (y > 0 &&
                 !CHECK_CLEAR(BOARDXY(x    , y - 1)) &&
                 !CHECK_MINE(BOARDXY(x    , y - 1)))
-                    gameClearCell(x    , y - 1);
+                    clearCell(x    , y - 1);
             if (x < size - 1 && y > 0        &&
                 !CHECK_CLEAR(BOARDXY(x + 1, y - 1)) &&
                 !CHECK_MINE(BOARDXY(x + 1, y - 1)))
-                    gameClearCell(x + 1, y - 1);
+                    clearCell(x + 1, y - 1);
             if (x > 0                        &&
                 !CHECK_CLEAR(BOARDXY(x - 1, y    )) &&
                 !CHECK_MINE(BOARDXY(x - 1, y    )))
-                    gameClearCell(x - 1, y    );
+                    clearCell(x - 1, y    );
             if (x < size - 1                 &&
                 !CHECK_CLEAR(BOARDXY(x + 1, y    )) &&
                 !CHECK_MINE(BOARDXY(x + 1, y    )))
-                    gameClearCell(x + 1, y    );
+                    clearCell(x + 1, y    );
             if (x > 0        && y < size - 1 &&
                 !CHECK_CLEAR(BOARDXY(x - 1, y + 1)) &&
                 !CHECK_MINE(BOARDXY(x - 1, y + 1)))
-                    gameClearCell(x - 1, y + 1);
+                    clearCell(x - 1, y + 1);
             if (                y < size - 1 &&
                 !CHECK_CLEAR(BOARDXY(x    , y + 1)) &&
                 !CHECK_MINE(BOARDXY(x    , y + 1)))
-                    gameClearCell(x    , y + 1);
+                    clearCell(x    , y + 1);
             if (x < size - 1 && y < size - 1 &&
                 !CHECK_CLEAR(BOARDXY(x + 1, y + 1)) &&
                 !CHECK_MINE(BOARDXY(x + 1, y + 1)))
-                    gameClearCell(x + 1, y + 1);
+                    clearCell(x + 1, y + 1);
         }
+    }
+}
+
+/* Add d to the count of every neighbor of cell i */
+static void
+patchCounts(int i, int d) {
+    int size = g->size;
+    unsigned char *counts = g->counts;
+    int x = i % size, y = i / size;
+    for (int ny = y - 1; ny <= y + 1; ny++)
+        for (int nx = x - 1; nx <= x + 1; nx++)
+            if (nx >= 0 && ny >= 0 && nx < size && ny < size &&
+                (nx != x || ny != y))
+                    COUNTXY(nx, ny) += d;
+}
+
+/* Move every mine in the 3x3 area around the first click into a spare
+    slot outside it, patching the count plane locally. O(1) in board size */
+static void
+relocateMines(int x, int y) {
+    /* Clicked cell first, it matters most if spares run out */
+    static const int dx[9] = { 0, -1,  0,  1, -1,  1, -1,  0,  1 };
+    static const int dy[9] = { 0, -1, -1, -1,  0,  0,  1,  1,  1 };
+    int size = g->size, *board = g->board, *spares = g->spares;
+    int nspares = g->nspares, s = 0;
+
+    for (int k = 0; k < 9; k++) {
+        int mx = x + dx[k], my = y + dy[k];
+        if (mx < 0 || my < 0 || mx >= size || my >= size ||
+            !CHECK_MINE(BOARDXY(mx, my)))
+                continue;
 
-        if (checkWin()) state = STATE_WON;
+        /* Find a spare outside the area */
+        while (s < nspares &&
+            spares[s] % size >= x - 1 && spares[s] % size <= x + 1 &&
+            spares[s] / size >= y - 1 && spares[s] / size <= y + 1)
+                s++;
+        if (s == nspares)
+            return;
+
+        BOARDXY(mx, my) &= ~(1u << CELL_BIT_MINE);
+        patchCounts((my * size) + mx, -1);
+        board[spares[s]] |= 1u << CELL_BIT_MINE;
+        patchCounts(spares[s], 1);
+        s++;
     }
 }
 
+void
+gameClearCell(int x, int y) {
+    int size = g->size, *board = g->board;
+    if (CHECK_CLEAR(BOARDXY(x, y)) || CHECK_FLAG(BOARDXY(x, y))) return;
+
+    publishBegin();
+    if (!g->started) {
+        if (safeFirstClick) relocateMines(x, y);
+        g->started = 1;
+    }
+    clearCell(x, y);
+    if (g->state == STATE_GOING && checkWin()) g->state = STATE_WON;
+    publishEnd();
+}
+
+/* Chord: if the flags around a cleared number match it, clear every other
+    neighbor in one batch and evaluate win once */
+void
+gameChordCell(int x, int y) {
+    int size = g->size, *board = g->board;
+    unsigned char *counts = g->counts;
+    if (!CHECK_CLEAR(BOARDXY(x, y)) || COUNTXY(x, y) == 0) return;
+
+    int flags = 0;
+    for (int ny = y - 1; ny <= y + 1; ny++)
+        for (int nx = x - 1; nx <= x + 1; nx++)
+            if (nx >= 0 && ny >= 0 && nx < size && ny < size &&
+                CHECK_FLAG(BOARDXY(nx, ny)))
+                    flags++;
+
+    if (flags != COUNTXY(x, y)) return;
+
+    publishBegin();
+    for (int ny = y - 1; ny <= y + 1; ny++)
+        for (int nx = x - 1; nx <= x + 1; nx++)
+            if (nx >= 0 && ny >= 0 && nx < size && ny < size)
+                clearCell(nx, ny);
+
+    if (g->state == STATE_GOING && checkWin()) g->state = STATE_WON;
+    publishEnd();
+}
+
 /* Toggle flag bit */
 void
 gameFlagCell(int x, int y) {
+    int size = g->size, *board = g->board;
     if (CHECK_CLEAR(BOARDXY(x, y))) return;
+    publishBegin();
     BOARDXY(x, y) ^= 1 << CELL_BIT_FLAG;
-    CHECK_FLAG(BOARDXY(x, y)) ? flagsLeft-- : flagsLeft++;
-    if (checkWin()) state = STATE_WON;
+    journalAdd((y * size) + x);
+    CHECK_FLAG(BOARDXY(x, y)) ? g->flagsLeft-- : g->flagsLeft++;
+    if (checkWin()) g->state = STATE_WON;
+    publishEnd();
 }
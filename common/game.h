@@ -20,6 +20,14 @@
 #ifndef _GAME_H
 #define _GAME_H
 
+#ifdef __KERNEL__
+    #include <linux/types.h>
+#else
+    #include <stddef.h>
+#endif
+
+#include "arena.h"
+
 /* Board access XY macro */
 #define BOARDXY(x, y)  board[((y) * size) + (x)]
 
@@ -41,19 +49,71 @@
 #define CHECK_FLAG(x)       (((x) >> CELL_BIT_FLAG) & 1u)
 #define CHECK_CLEAR(x)      (((x) >> CELL_BIT_CLEAR) & 1u)
 
+/* Largest side whose cell count still fits an int */
+#define GAME_MAX_SIZE       46340
+
+/* Most cells a single move can report as changed */
+#define GAME_JOURNAL_SIZE   16384
+
 /* Game state */
 #define STATE_GOING         0u
 #define STATE_LOST          1u
 #define STATE_WON           2u
 
+/* Header at the start of the game memory, followed by the board and the
+    neighbor count plane at the given offsets from it. seq is odd while a
+    move is being applied: readers of an exported board copy what they need
+    and retry if seq was odd or changed across the copy (seqlock) */
+typedef struct {
+    volatile unsigned int seq;
+    int size, mines, state, flagsLeft;
+    unsigned int boardOffset, countsOffset;
+} game_shared_t;
+
+/* First click safety: free cells reserved on init to relocate mines into */
+#define GAME_SPARE_SLOTS    9
+
+/* Everything one game needs. The API works on the selected game, a zeroed
+    game_t is ready for gameInit */
+typedef struct {
+    /* Every per-game structure is carved out of this */
+    arena_t arena;
+    /* Caller provided memory for the arena, e.g. a shared memory segment */
+    void *extMem;
+    size_t extSize;
+    /* Published header, first thing in the arena */
+    game_shared_t *shared;
+    /* Seqlock counter, kept across games so versions never repeat */
+    unsigned int seq;
+    int *board;
+    /* Neighbor mine count plane, precomputed on init */
+    unsigned char *counts;
+    int size, mines, flagsLeft, state;
+    /* Indices of the cells changed by the last move, njournal past
+        journalSize means it overflowed */
+    int *journal;
+    int njournal, journalSize;
+    int spares[GAME_SPARE_SLOTS];
+    int nspares, started;
+} game_t;
+
+void gameSelect(game_t *game);
+game_t *gameSelected(void);
+size_t gameMemorySize(int size);
+void gameSetMemory(void *mem, size_t size);
 int gameInit(int size, int mines);
 void gameDestroy(void);
 const int * gameGetBoard(void);
 int gameGetState(void);
+int gameGetMines(void);
+unsigned int gameGetVersion(void);
+const int * gameGetChanges(int *n);
 void gameSetState(int s);
+void gameSetSafeFirstClick(int enable);
 int gameGetSurroundingMines(int x, int y);
 int gameGetFlagsLeft(void);
 void gameClearCell(int x, int y);
 void gameFlagCell(int x, int y);
+void gameChordCell(int x, int y);
 
 #endif
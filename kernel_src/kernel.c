@@ -95,28 +95,40 @@ warm_start:
             case '1': {
                 kprintf("Starting game with vgacon frontend, %dx%d in size with %d mines\n",
                     size, size, mines);
-                gameInit(size, mines);
+                if (gameInit(size, mines) < 0) {
+                    kprintf("Cannot start a game of that size ");
+                    break;
+                }
                 vgacli_start(gameGetBoard(), size);
                 goto warm_start;
             } break;
             case '2': {
                 kprintf("Starting game with vgatxt frontend, %dx%d in size with %d mines\n",
                     size, size, mines);
-                gameInit(size, mines);
+                if (gameInit(size, mines) < 0) {
+                    kprintf("Cannot start a game of that size ");
+                    break;
+                }
                 vgatui_start(gameGetBoard(), size, 0);
                 goto warm_start;
             } break;
             case '3': {
                 kprintf("Starting game with vgatgr frontend, %dx%d in size with %d mines\n",
                     size, size, mines);
-                gameInit(size, mines);
+                if (gameInit(size, mines) < 0) {
+                    kprintf("Cannot start a game of that size ");
+                    break;
+                }
                 vgatui_start(gameGetBoard(), size, 1);
                 goto warm_start;
             } break;
             case '4': {
                 kprintf("Starting game with vgagra frontend, %dx%d in size with %d mines\n",
                     size, size, mines);
-                gameInit(size, mines);
+                if (gameInit(size, mines) < 0) {
+                    kprintf("Cannot start a game of that size ");
+                    break;
+                }
                 vgagra_start(gameGetBoard(), size, vgagmode);
                 goto cold_start;
             } break;
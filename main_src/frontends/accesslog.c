@@ -0,0 +1,230 @@
+/*
+
+    arfminesweeper: Cross-plataform multi-frontend game
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    accesslog.c: Access log off the request path. Every thread copies its
+        records into a ring of its own, a background thread formats them
+        and writes them out in batches
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "accesslog.h"
+
+#define RING_SIZE       8192    /* records, a power of 2 */
+#define MAX_RINGS       256
+#define OUT_SIZE        65536   /* bytes per write */
+#define LINE_MAX_LEN    (ACCESS_LOG_TARGET * 4 + 160)
+#define IDLE_SLEEP_NS   10000000
+
+/* Single producer, single consumer: head is only written by the thread
+    logging, tail by the drain thread, each on its own cache line */
+typedef struct {
+    uint64_t head;
+    char pad0[56];
+    uint64_t tail;
+    char pad1[56];
+    uint64_t dropped;       /* records that found the ring full */
+    access_rec_t recs[RING_SIZE];
+} ring_t;
+
+static ring_t *rings[MAX_RINGS];
+static int nrings = 0;
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local ring_t *ring = NULL;
+
+static int logFd = -1;
+static pthread_t drainThread;
+static int draining = 0, stopping = 0;
+
+/* Target as is, but for quotes, backslashes and anything unprintable */
+static char *
+escapeTarget(char *o, const char *p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char ch = p[i];
+        if (ch < 0x20 || ch >= 0x7f || ch == '"' || ch == '\\')
+            o += sprintf(o, "\\x%02x", ch);
+        else
+            *o++ = ch;
+    }
+    return o;
+}
+
+static size_t
+formatRec(char *o, const access_rec_t *r) {
+    static char stamp[32];
+    static time_t stampSec = -1;
+
+    /* Dates change once a second, not once a record */
+    time_t sec = r->time / 1000000;
+    if (sec != stampSec) {
+        struct tm tm;
+        gmtime_r(&sec, &tm);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+        stampSec = sec;
+    }
+
+    const unsigned char *a = (const unsigned char*)&r->addr;
+    char *start = o;
+    o += sprintf(o, "time=%s.%06uZ thread=%u addr=%u.%u.%u.%u "
+        "method=%.8s target=\"", stamp, (unsigned)(r->time % 1000000),
+        r->thread, a[0], a[1], a[2], a[3], r->method);
+    size_t kept = r->targetLen < ACCESS_LOG_TARGET ? r->targetLen :
+        ACCESS_LOG_TARGET;
+    o = escapeTarget(o, r->target, kept);
+    if (r->targetLen > kept)
+        o += sprintf(o, "...");
+    o += sprintf(o, "\" status=%u latency_us=%u\n", r->status, r->latency);
+    return o - start;
+}
+
+static void
+flush(char *out, size_t *len) {
+    size_t off = 0;
+    while (off < *len) {
+        ssize_t w = write(logFd, out + off, *len - off);
+        if (w <= 0)
+            break;
+        off += w;
+    }
+    *len = 0;
+}
+
+/* Drain every ring, writing whenever the buffer fills and once done.
+    Returns whether there was anything */
+static int
+drainRings(char *out, uint64_t *dropped) {
+    size_t len = 0;
+    int found = 0;
+    int n = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < n; i++) {
+        ring_t *q = rings[i];
+        uint64_t t = q->tail;
+        uint64_t h = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        for (; t != h; t++) {
+            if (len + LINE_MAX_LEN > OUT_SIZE)
+                flush(out, &len);
+            len += formatRec(out + len, &q->recs[t & (RING_SIZE - 1)]);
+            found = 1;
+        }
+        __atomic_store_n(&q->tail, t, __ATOMIC_RELEASE);
+
+        uint64_t d = __atomic_load_n(&q->dropped, __ATOMIC_RELAXED);
+        if (d != dropped[i]) {
+            if (len + LINE_MAX_LEN > OUT_SIZE)
+                flush(out, &len);
+            len += sprintf(out + len, "access log: thread %d dropped "
+                "%llu records\n", i, (unsigned long long)(d - dropped[i]));
+            dropped[i] = d;
+        }
+    }
+    flush(out, &len);
+    return found;
+}
+
+static void *
+drainRun(void *arg) {
+    (void)arg;
+    static char out[OUT_SIZE];
+    static uint64_t dropped[MAX_RINGS];
+
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        /* Nothing on the request path wakes it, poll while idle */
+        if (!drainRings(out, dropped)) {
+            struct timespec ts = { 0, IDLE_SLEEP_NS };
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    /* What was logged before the stop */
+    drainRings(out, dropped);
+    return NULL;
+}
+
+/* Start logging to path, or stdout if NULL */
+int
+accessLogOpen(const char *path) {
+    logFd = path ? open(path, O_WRONLY | O_CREAT | O_APPEND, 0644) : 1;
+    if (logFd < 0)
+        return -1;
+
+    if (pthread_create(&drainThread, NULL, drainRun, NULL) != 0)
+        return -1;
+    draining = 1;
+    return 0;
+}
+
+/* Write out every record logged so far and stop. Records logged after
+    it are dropped */
+void
+accessLogStop(void) {
+    if (!draining)
+        return;
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(drainThread, NULL);
+    draining = 0;
+
+    if (logFd > 1)
+        close(logFd);
+    logFd = -1;
+}
+
+/* Give the calling thread a ring, before it logs anything */
+int
+accessLogThread(void) {
+    ring_t *q = calloc(1, sizeof(ring_t));
+    if (q == NULL)
+        return -1;
+
+    pthread_mutex_lock(&ringsLock);
+    if (nrings == MAX_RINGS) {
+        pthread_mutex_unlock(&ringsLock);
+        free(q);
+        return -1;
+    }
+    rings[nrings] = q;
+    __atomic_store_n(&nrings, nrings + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ringsLock);
+
+    ring = q;
+    return 0;
+}
+
+/* Copy a record into this thread's ring, never waits. Dropped if the ring
+    is full, or the thread has none */
+void
+accessLog(const access_rec_t *r) {
+    ring_t *q = ring;
+    if (q == NULL)
+        return;
+
+    uint64_t h = q->head;
+    if (h - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+        __atomic_store_n(&q->dropped, q->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    q->recs[h & (RING_SIZE - 1)] = *r;
+    __atomic_store_n(&q->head, h + 1, __ATOMIC_RELEASE);
+}
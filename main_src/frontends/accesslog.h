@@ -0,0 +1,46 @@
+/*
+
+    arfminesweeper: Cross-plataform multi-frontend game
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+*/
+
+#ifndef _ACCESSLOG_H
+#define _ACCESSLOG_H
+
+#include <stdint.h>
+
+#define ACCESS_LOG_TARGET   100     /* bytes of the request target kept */
+
+/* One request, fixed size so a record is a copy into a ring slot */
+typedef struct {
+    uint64_t time;          /* us since the epoch */
+    uint32_t latency;       /* us */
+    uint32_t addr;          /* client IPv4, network order */
+    uint16_t status;
+    uint8_t thread;
+    uint8_t targetLen;      /* of the whole target, up to 255 */
+    char method[8];
+    char target[ACCESS_LOG_TARGET];
+} access_rec_t;
+
+int accessLogOpen(const char *path);
+int accessLogThread(void);
+void accessLog(const access_rec_t *r);
+void accessLogStop(void);
+
+#endif /* _ACCESSLOG_H */
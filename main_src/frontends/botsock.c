@@ -0,0 +1,337 @@
+/*
+
+    arfminesweeper: Cross-plataform multi-frontend game
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    botsock.c: Binary bot protocol over a unix domain socket
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <common/frontconf.h>
+#include "botsock.h"
+#include <common/game.h>
+
+#define RECV_SIZE   (sizeof(bot_req_t) * (1 + BOT_BATCH_MAX))
+#define FLUSH_SIZE  262144  /* send early if this many responses pile up */
+
+static const int *board = NULL;
+static int size = 0;
+
+static int lfd = -1;
+
+/* Pipelined requests are read in bulk, responses accumulate here and go
+    out with one send per read */
+static char inBuff[RECV_SIZE];
+static char *outBuff = NULL;
+static size_t outLen = 0, outCap = 0;
+
+static int
+outReserve(size_t n) {
+    if (outLen + n <= outCap)
+        return 0;
+
+    size_t cap = outCap ? outCap : FLUSH_SIZE;
+    while (cap < outLen + n) cap *= 2;
+
+    char *p = realloc(outBuff, cap);
+    if (p == NULL)
+        return -1;
+
+    outBuff = p;
+    outCap = cap;
+    return 0;
+}
+
+static int
+flush(int cfd) {
+    size_t off = 0;
+    while (off < outLen) {
+        ssize_t r = send(cfd, outBuff + off, outLen - off, MSG_NOSIGNAL);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        off += r;
+    }
+    outLen = 0;
+    return 0;
+}
+
+/* Append a response header at *off in outBuff, -1 if there is no room */
+static int
+beginResponse(size_t *off) {
+    if (outReserve(sizeof(bot_resp_t)) < 0)
+        return -1;
+    *off = outLen;
+    memset(outBuff + *off, 0, sizeof(bot_resp_t));
+    outLen += sizeof(bot_resp_t);
+    return 0;
+}
+
+static void
+endResponse(size_t off) {
+    bot_resp_t *resp = (bot_resp_t*)(outBuff + off);
+    resp->state = gameGetState();
+    resp->version = gameGetVersion();
+    resp->flagsLeft = gameGetFlagsLeft();
+}
+
+static void
+setStatus(size_t off, int status) {
+    bot_resp_t *resp = (bot_resp_t*)(outBuff + off);
+    if (resp->status == BOT_STATUS_OK)
+        resp->status = status;
+}
+
+static void
+addChange(size_t off, int i) {
+    if (outReserve(sizeof(bot_change_t)) < 0) {
+        setStatus(off, BOT_STATUS_RESYNC);
+        return;
+    }
+
+    bot_change_t *c = (bot_change_t*)(outBuff + outLen);
+    c->index = i;
+    c->cell = board[i];
+    if (gameGetState() == STATE_GOING)
+        c->cell &= ~(1u << CELL_BIT_MINE);
+    c->count = CHECK_CLEAR(board[i]) ?
+        gameGetSurroundingMines(i % size, i / size) : 0;
+    c->pad = 0;
+    outLen += sizeof(bot_change_t);
+
+    ((bot_resp_t*)(outBuff + off))->nchanges++;
+}
+
+/* Apply one clear/flag/chord and list the cells it changed */
+static void
+applyMove(size_t off, const bot_req_t *req) {
+    if (board == NULL || req->x >= (uint32_t)size || req->y >= (uint32_t)size) {
+        setStatus(off, BOT_STATUS_EINVAL);
+        return;
+    }
+
+    unsigned int version = gameGetVersion();
+
+    switch (req->op) {
+    case BOT_OP_CLEAR: gameClearCell(req->x, req->y); break;
+    case BOT_OP_FLAG:  gameFlagCell(req->x, req->y); break;
+    case BOT_OP_CHORD: gameChordCell(req->x, req->y); break;
+    default: setStatus(off, BOT_STATUS_EINVAL); return;
+    }
+
+    /* Nothing published, nothing changed */
+    if (gameGetVersion() == version)
+        return;
+
+    int n = 0;
+    const int *changes = gameGetChanges(&n);
+    if (changes == NULL) {
+        setStatus(off, BOT_STATUS_RESYNC);
+        return;
+    }
+
+    for (int i = 0; i < n; i++)
+        addChange(off, changes[i]);
+}
+
+/* Handle the request at req, returns bytes consumed, past avail for a
+    batch to skip, 0 if incomplete and -1 if it can't be answered */
+static int
+handleRequest(const bot_req_t *req, size_t avail) {
+    size_t off = 0;
+
+    switch (req->op) {
+    case BOT_OP_INIT: {
+        if (beginResponse(&off) < 0)
+            return -1;
+        if (req->x == 0 || req->x > GAME_MAX_SIZE ||
+            req->y >= req->x * req->x ||
+            gameInit(req->x, req->y) < 0) {
+                setStatus(off, BOT_STATUS_EINVAL);
+                board = NULL;
+        }
+        else {
+            board = gameGetBoard();
+            size = req->x;
+        }
+    } break;
+    case BOT_OP_CLEAR:
+    case BOT_OP_FLAG:
+    case BOT_OP_CHORD: {
+        if (beginResponse(&off) < 0)
+            return -1;
+        applyMove(off, req);
+    } break;
+    case BOT_OP_BATCH: {
+        size_t need = sizeof(bot_req_t) * (1 + req->count);
+        if (req->count > BOT_BATCH_MAX) {
+            /* Never fits the buffer, refused and skipped as it arrives */
+            if (beginResponse(&off) < 0)
+                return -1;
+            setStatus(off, BOT_STATUS_EINVAL);
+            endResponse(off);
+            return need;
+        }
+        if (avail < need)
+            return 0;
+
+        if (beginResponse(&off) < 0)
+            return -1;
+        for (int i = 1; i <= req->count; i++)
+            applyMove(off, req + i);
+
+        endResponse(off);
+        return need;
+    } break;
+    case BOT_OP_BOARD: {
+        if (beginResponse(&off) < 0)
+            return -1;
+        if (board == NULL)
+            setStatus(off, BOT_STATUS_EINVAL);
+        else if (outReserve(sizeof(bot_change_t) * size * size) < 0)
+            setStatus(off, BOT_STATUS_RESYNC);
+        else
+            for (int i = 0; i < size * size; i++)
+                addChange(off, i);
+    } break;
+    default: {
+        if (beginResponse(&off) < 0)
+            return -1;
+        setStatus(off, BOT_STATUS_EINVAL);
+    } break;
+    }
+
+    endResponse(off);
+    return sizeof(bot_req_t);
+}
+
+static void
+clientLoop(int cfd) {
+    size_t inLen = 0, skip = 0;
+
+    while (1) {
+        ssize_t r = recv(cfd, inBuff + inLen, RECV_SIZE - inLen, 0);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            printf("Error receiving\n");
+            return;
+        }
+        else if (r == 0) {
+            printf("Client exited\n");
+            return;
+        }
+        inLen += r;
+
+        /* What is left of a refused batch, then every complete request */
+        size_t off = skip < inLen ? skip : inLen;
+        skip -= off;
+        while (inLen - off >= sizeof(bot_req_t)) {
+            int n = handleRequest((const bot_req_t*)(inBuff + off),
+                inLen - off);
+            if (n < 0) {
+                printf("Error: Out of memory\n");
+                return;
+            }
+            if (n == 0)
+                break;
+            off += n;
+            if (off > inLen) {
+                skip = off - inLen;
+                off = inLen;
+            }
+
+            if (outLen >= FLUSH_SIZE && flush(cfd) < 0)
+                return;
+        }
+
+        memmove(inBuff, inBuff + off, inLen - off);
+        inLen -= off;
+
+        if (flush(cfd) < 0) {
+            printf("Error sending\n");
+            return;
+        }
+    }
+}
+
+int
+botsockStart(const int *lboard, int lsize) {
+    board = lboard;
+    size = lsize;
+
+    struct sockaddr_un addr = { 0 };
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, BOT_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+
+    if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        printf("Error creating socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    unlink(BOT_SOCKET_PATH);
+    if (bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        printf("Error binding socket: %s\n", strerror(errno));
+        return -1;
+    }
+    /* Only this user's bots, before anything can connect */
+    if (chmod(BOT_SOCKET_PATH, 0600) < 0) {
+        printf("Error restricting socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (listen(lfd, SOMAXCONN) < 0)
+        return -1;
+
+    printf("Listening on %s\n", BOT_SOCKET_PATH);
+
+    /* One bot at a time, there is one game */
+    while (1) {
+        int cfd = accept(lfd, NULL, NULL);
+        if (cfd < 0) {
+            printf("Error accepting client\n");
+            continue;
+        }
+
+        printf("Accepted connection\n");
+        clientLoop(cfd);
+        close(cfd);
+        outLen = 0;
+    }
+
+    return 0;
+}
+
+void
+botsockDestroy() {
+    if (lfd >= 0) {
+        close(lfd);
+        unlink(BOT_SOCKET_PATH);
+    }
+    free(outBuff);
+    outBuff = NULL;
+    outCap = outLen = 0;
+}
@@ -0,0 +1,75 @@
+/*
+
+    arfminesweeper: Cross-plataform multi-frontend game
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef _BOTSOCK_H
+#define _BOTSOCK_H
+
+#include <stdint.h>
+
+/* Binary bot protocol over a unix domain socket, host byte order.
+    Clients may pipeline any number of requests, every request gets exactly
+    one response, in order. */
+
+/* Request ops */
+#define BOT_OP_INIT     0u  /* x = size, y = mines */
+#define BOT_OP_CLEAR    1u
+#define BOT_OP_FLAG     2u
+#define BOT_OP_CHORD    3u
+#define BOT_OP_BATCH    4u  /* followed by count clear/flag/chord requests */
+#define BOT_OP_BOARD    5u  /* every cell as a change, to resync */
+
+/* Most requests in one batch. A bigger one is answered EINVAL as a whole,
+    none of its moves applied, and the stream goes on after it */
+#define BOT_BATCH_MAX   5460
+
+/* Response status */
+#define BOT_STATUS_OK       0u
+#define BOT_STATUS_EINVAL   1u  /* bad op or out of bounds move */
+#define BOT_STATUS_RESYNC   2u  /* too many changes to list, send BOARD */
+
+typedef struct {
+    uint8_t op;
+    uint8_t pad;
+    uint16_t count;
+    uint32_t x, y;
+} bot_req_t;
+
+/* Followed by nchanges bot_change_t */
+typedef struct {
+    uint8_t status;
+    uint8_t state;      /* STATE_* */
+    uint16_t pad;
+    uint32_t version;
+    int32_t flagsLeft;
+    uint32_t nchanges;
+} bot_resp_t;
+
+/* Mines are only revealed once the game is over */
+typedef struct {
+    uint32_t index;
+    uint8_t cell;       /* CELL_* bits */
+    uint8_t count;      /* surrounding mines, if cleared */
+    uint16_t pad;
+} bot_change_t;
+
+int botsockStart(const int *lboard, int lsize);
+void botsockDestroy();
+
+#endif /* _BOTSOCK_H */
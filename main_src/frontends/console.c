@@ -67,6 +67,7 @@ printHelp() {
     printf("\thelp:             Get this message\n"
            "\tclear | c <x, y>: Clear cell\n"
            "\tflag  | f <x, y>: Place flag\n"
+           "\tchord | m <x, y>: Clear around a satisfied number\n"
            "\tquit  | q:        Quit\n");
 }
 
@@ -105,6 +106,14 @@ conStart(const int *lboard, int lsize) {
         if (!strncmp(buffin, "help", 4) || !strncmp(buffin, "h", 1)) {
             printHelp();
         }
+        else if (!strncmp(buffin, "chord", 5) || !strncmp(buffin, "m", 1)) {
+            if (parseXYCommand(buffin, &x, &y)) continue;
+            if (x < 0 || y < 0 || x >= size || y >= size) {
+                printf("?Out of board bounds\n"); continue;
+            }
+            printf("Chorded (%d, %d)\n", x, y);
+            gameChordCell(x, y);
+        }
         else if (!strncmp(buffin, "clear", 5) || !strncmp(buffin, "c", 1)) {
             if (parseXYCommand(buffin, &x, &y)) continue;
             if (x < 0 || y < 0 || x >= size || y >= size) {
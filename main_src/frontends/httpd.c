@@ -20,325 +20,2757 @@
 
 */
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #ifdef _WIN32
 #include <WinSock2.h>
 #define close closesocket
 #else
 #include <errno.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+#ifdef HTTPD_URING
+#include <poll.h>
+#include <liburing.h>
+#endif
+#endif
+
+#include <common/frontconf.h>
+#include "httpd.h"
+#include "httpparse.h"
+#include "websocket.h"
+#include "session.h"
+#include "metrics.h"
+#include "accesslog.h"
+#include <common/game.h>
+
+#ifdef HTTPD_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HTTPD_BROTLI
+#include <brotli/encode.h>
+#endif
+#if defined(HTTPD_ZLIB) || defined(HTTPD_BROTLI)
+#define HTTPD_COMPRESS
+#endif
+
+#define RECV_SIZE 8192
+#define MAX_EVENTS 256
+#define IDLE_TIMEOUT 15     /* s a keep-alive connection may sit idle */
+#define IOV_BATCH 64        /* segments per sendmsg */
+#define STREAM_CELLS 4096   /* boards bigger than this are streamed */
+#define STREAM_CHUNK 16384  /* bytes per chunk, the only buffer a stream uses */
+#define WS_QUEUE_MAX 262144 /* bytes a websocket client may lag before it
+                                skips deltas for one whole board later */
+#define WS_STALE_TIMEOUT 30 /* s it may stay that far behind */
+#define OUT_QUEUE_MAX 262144 /* bytes of responses queued before pipelined
+                                requests wait for the client to read them */
+#define FD_RESERVE 64       /* descriptors kept from connections, for
+                                listeners, pipes, files and shedding */
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* Everything mutable is per reactor thread, each runs its own event loop
+    on its own listener and owns a shard of the sessions */
+static _Thread_local const int* board = NULL;
+static int size = 0;
+
+/* Access log file, stdout if NULL */
+static const char *accessLogPath = NULL;
+/* Connections open at once over every reactor, past it new ones are shed
+    with a 503. 0 for as many as there are descriptors for */
+static int maxConns = 0;
+static int openConns = 0;
+/* Per-session games under this many bytes, 0 to share one board */
+static size_t sessionMem = 0;
+/* Shared board, owned by the first reactor */
+static session_t sharedSession = { 0 };
+/* Session whose game is selected */
+static _Thread_local session_t *cur = NULL;
+/* In board etags, so versions from an earlier run never match */
+static unsigned int bootId = 0;
+/* Key of the public ids spectators watch a game by, see watchId */
+static uint32_t watchKey[4];
+
+#define SESSION_COOKIE  "msid"
+
+
+/* status, type, length, connection, extra headers */
+static const char* responseHeaders =
+"HTTP/1.1 %s\r\n"
+"Server: arfminesweeper httpd\r\n"
+"Content-Type: %s\r\n"
+"Content-Length: %zu\r\n"
+"Connection: %s\r\n"
+"%s"
+"\r\n";
+
+/* status, type, connection, extra headers */
+static const char* chunkedHeaders =
+"HTTP/1.1 %s\r\n"
+"Server: arfminesweeper httpd\r\n"
+"Content-Type: %s\r\n"
+"Transfer-Encoding: chunked\r\n"
+"Connection: %s\r\n"
+"%s"
+"\r\n";
+
+/* status, type, extra headers. The body ends where the connection does,
+    for HTTP/1.0 clients that take no chunks */
+static const char* untilCloseHeaders =
+"HTTP/1.1 %s\r\n"
+"Server: arfminesweeper httpd\r\n"
+"Content-Type: %s\r\n"
+"Connection: close\r\n"
+"%s"
+"\r\n";
+
+/* Whole answer to a connection past the limit, before reading anything */
+static const char* shedResponse =
+"HTTP/1.1 503 Service Unavailable\r\n"
+"Server: arfminesweeper httpd\r\n"
+"Content-Type: text/plain\r\n"
+"Content-Length: 12\r\n"
+"Retry-After: 1\r\n"
+"Connection: close\r\n"
+"\r\n"
+"Server busy\n";
+
+/* accept, extra headers */
+static const char* wsHeaders =
+"HTTP/1.1 101 Switching Protocols\r\n"
+"Server: arfminesweeper httpd\r\n"
+"Upgrade: websocket\r\n"
+"Connection: Upgrade\r\n"
+"Sec-WebSocket-Accept: %s\r\n"
+"%s"
+"\r\n";
+
+/* extra headers */
+static const char* eventsHeaders =
+"HTTP/1.1 200 OK\r\n"
+"Server: arfminesweeper httpd\r\n"
+"Content-Type: text/event-stream\r\n"
+"Cache-Control: no-cache\r\n"
+"Connection: keep-alive\r\n"
+"%s"
+"\r\n";
+
+/* connection, extra headers */
+static const char* notModifiedHeaders =
+"HTTP/1.1 304 Not Modified\r\n"
+"Server: arfminesweeper httpd\r\n"
+"Connection: %s\r\n"
+"%s"
+"\r\n";
+
+/* session id */
+static const char* cookieHeader =
+"Set-Cookie: " SESSION_COOKIE "=%016llx; Path=/; HttpOnly; SameSite=Lax\r\n";
+
+/* etag, revalidated on every use */
+static const char* versionHeaders =
+"ETag: %s\r\n"
+"Cache-Control: no-cache\r\n"
+#ifdef HTTPD_COMPRESS
+"Vary: Accept-Encoding\r\n"
+#endif
+;
+
+/* content coding */
+static const char* encodingHeader =
+"Content-Encoding: %s\r\n";
+
+/* Content codings, best first */
+#define ENC_IDENTITY    0
+#define ENC_BR          1
+#define ENC_GZIP        2
+#define ENC_DEFLATE     3
+
+static const char *encodingNames[] = { "identity", "br", "gzip", "deflate" };
+
+/* status, type, length, etag, connection */
+static const char* assetHeaders =
+"HTTP/1.1 200 OK\r\n"
+"Server: arfminesweeper httpd\r\n"
+"Content-Type: %s\r\n"
+"Content-Length: %zu\r\n"
+"ETag: %s\r\n"
+"Cache-Control: public, max-age=86400\r\n"
+"Connection: %s\r\n"
+"\r\n";
+
+/* etag, connection */
+static const char* assetNotModifiedHeaders =
+"HTTP/1.1 304 Not Modified\r\n"
+"Server: arfminesweeper httpd\r\n"
+"ETag: %s\r\n"
+"Cache-Control: public, max-age=86400\r\n"
+"Connection: %s\r\n"
+"\r\n";
+
+#define LEN_CHUNKED ((size_t)-1)
+#define LEN_UNTIL_CLOSE ((size_t)-2)
+
+static char* htmlContent = NULL;
+
+/* Reference counted response buffer, shared by every queue holding it */
+typedef struct {
+    int refs;
+    size_t len, cap;
+    char data[];
+} buf_t;
+
+static buf_t *
+bufNew(size_t cap) {
+    buf_t *b = malloc(sizeof(buf_t) + cap);
+    if (b == NULL)
+        return NULL;
+    b->refs = 1;
+    b->len = 0;
+    b->cap = cap;
+    return b;
+}
+
+static buf_t *
+bufRef(buf_t *b) {
+    if (b) b->refs++;
+    return b;
+}
+
+static void
+bufUnref(buf_t *b) {
+    if (b && --b->refs == 0)
+        free(b);
+}
+
+static void
+bufAppend(buf_t *b, const char *s, size_t len) {
+    memcpy(b->data + b->len, s, len);
+    b->len += len;
+}
+
+/* Static file, answered with whole responses built once at startup. They
+    are never freed, so every reactor queues them without references */
+typedef struct {
+    const char *path, *file, *type;
+    char etag[20];
+    buf_t *ok[2], *notModified[2];     /* keep-alive, close */
+} asset_t;
+
+static asset_t assets[] = {
+    { "/flag.png", "../assets/flag.png", "image/png", "", { NULL }, { NULL } },
+    { "/favicon.ico", "../assets/flag.ico", "image/x-icon", "", { NULL },
+        { NULL } },
+    { "/canvas", "../assets/mscanvas.html", "text/html", "", { NULL },
+        { NULL } },
+};
+#define NASSETS (sizeof(assets) / sizeof(assets[0]))
+
+/* Page template split around its %d (flags left) and two %s (board rows,
+    game over script), done once */
+#define TPL_HEAD        0
+#define TPL_PRE_BOARD   1
+#define TPL_PRE_SCRIPT  2
+#define TPL_TAIL        3
+static slice_t tpl[4];
+
+/* Board cell fragments, the cell index goes between the parts */
+typedef struct {
+    const char *part[3];
+    size_t len[3];
+    int nidx;
+} frag_t;
+
+static frag_t fragClear[9], fragFlag, fragTile;
+static char fragClearText[9][96];
+static size_t fragMaxLen = 0;
+
+static const char *alertLost = NULL, *alertWon = NULL;
+
+static void
+fragInit(frag_t *f, const char *p0, const char *p1, const char *p2) {
+    f->part[0] = p0;
+    f->part[1] = p1;
+    f->part[2] = p2;
+    f->nidx = p2 ? 2 : p1 ? 1 : 0;
+    size_t total = 0;
+    for (int i = 0; i <= f->nidx; i++) {
+        f->len[i] = strlen(f->part[i]);
+        total += f->len[i];
+    }
+    /* Up to 10 digits per index */
+    total += f->nidx * 10;
+    if (total > fragMaxLen) fragMaxLen = total;
+}
+
+/* JS string literal contents: newlines escaped */
+static const char *
+escapeLf(const char *str) {
+    char *out = malloc(strlen(str) * 2 + 1), *o = out;
+    for (; *str; str++) {
+        if (*str == '\n') { *o++ = '\\'; *o++ = 'n'; }
+        else *o++ = *str;
+    }
+    *o = '\0';
+    return out;
+}
+
+static void
+splitTemplate(const char *html) {
+    const char *d = strstr(html, "%d");
+    const char *s1 = d ? strstr(d + 2, "%s") : NULL;
+    const char *s2 = s1 ? strstr(s1 + 2, "%s") : NULL;
+    if (s2 == NULL) {
+        printf("Warning: Bad page template\n");
+        tpl[TPL_HEAD].p = html;
+        tpl[TPL_HEAD].len = strlen(html);
+        return;
+    }
+    tpl[TPL_HEAD] = (slice_t){ html, d - html };
+    tpl[TPL_PRE_BOARD] = (slice_t){ d + 2, s1 - (d + 2) };
+    tpl[TPL_PRE_SCRIPT] = (slice_t){ s1 + 2, s2 - (s1 + 2) };
+    tpl[TPL_TAIL] = (slice_t){ s2 + 2, strlen(s2 + 2) };
+}
+
+static void
+renderInit(void) {
+    static const char *colors[9] = { NULL, "blue", "green", "red",
+        "darkblue", "darkred", "darkcyan", "black", "darkgrey" };
+
+    fragInit(&fragClear[0], "<td>\n</td>\n", NULL, NULL);
+    for (int n = 1; n <= 8; n++) {
+        snprintf(fragClearText[n], sizeof(fragClearText[n]),
+            "\" style=\"color: %s;\">%d</a>\n</td>\n", colors[n], n);
+        fragInit(&fragClear[n], "<td>\n<a href=\"?chord=",
+            fragClearText[n], NULL);
+    }
+    fragInit(&fragFlag, "<td><button name=\"btn\" class=\"cell\"><img id=\"",
+        "\" src=\"/flag.png\"></button></td>\n", NULL);
+    fragInit(&fragTile, "<td><a href=\"?clear=",
+        "\" name=\"btn\"><button id=\"",
+        "\" class=\"cell\"></button></a></td>\n");
+
+    alertLost = escapeLf("alert(\"" TXT_LOST "\");");
+    alertWon = escapeLf("alert(\"" TXT_WON "\");");
+
+    splitTemplate(htmlContent);
+}
+
+/* Decimal digits of n at the end of buff, returns where they start */
+static char *
+utoa10(unsigned int n, char *end) {
+    do { *--end = '0' + (n % 10); n /= 10; } while (n);
+    return end;
+}
+
+static char *
+emitFrag(char *o, const frag_t *f, const char *num, size_t numLen) {
+    memcpy(o, f->part[0], f->len[0]);
+    o += f->len[0];
+    for (int i = 1; i <= f->nidx; i++) {
+        memcpy(o, num, numLen);
+        o += numLen;
+        memcpy(o, f->part[i], f->len[i]);
+        o += f->len[i];
+    }
+    return o;
+}
+
+/* Room one more cell needs, with its row tags */
+#define CELL_ROOM   (fragMaxLen + 11)
+
+/* Render board cells from *cell on while they fit before end, advancing
+    *cell, returns the new end of output. Linear in the number of cells */
+static char *
+renderCells(char *o, const char *end, int *cell) {
+    char numBuff[12];
+    char *numEnd = numBuff + sizeof(numBuff);
+
+    for (; *cell < size * size && (size_t)(end - o) >= CELL_ROOM; (*cell)++) {
+        int x = *cell % size, y = *cell / size;
+        char *num = utoa10(*cell, numEnd);
+        const frag_t *f;
+
+        if (x == 0) {
+            memcpy(o, "<tr>\n", 5);
+            o += 5;
+        }
+
+        /* If clear, show n of mines, flag, or otherwise just a tile */
+        if (CHECK_CLEAR(BOARDXY(x, y)))
+            f = &fragClear[gameGetSurroundingMines(x, y)];
+        else if (CHECK_FLAG(BOARDXY(x, y)))
+            f = &fragFlag;
+        else
+            f = &fragTile;
+
+        o = emitFrag(o, f, num, numEnd - num);
+
+        if (x == size - 1) {
+            memcpy(o, "</tr>\n", 6);
+            o += 6;
+        }
+    }
+    return o;
+}
+
+/* Render all the board rows at once */
+static buf_t *
+renderBoard(void) {
+    buf_t *b = bufNew((size_t)size * size * CELL_ROOM);
+    if (b == NULL)
+        return NULL;
+
+    int cell = 0;
+    b->len = renderCells(b->data, b->data + b->cap, &cell) - b->data;
+    return b;
+}
+
+/* Event loop: epoll where available, poll(2) elsewhere */
+#define EV_IN   1
+#define EV_OUT  2
+
+typedef struct {
+    void *ptr;
+    int events;
+} ev_t;
+
+#ifdef __linux__
+static _Thread_local int epfd = -1;
+
+static int
+evInit(void) {
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    return epfd < 0 ? -1 : 0;
+}
+
+static int
+evCtl(int op, int fd, int events, void *ptr) {
+    struct epoll_event ev = { 0 };
+    ev.events = (events & EV_IN ? EPOLLIN : 0) |
+        (events & EV_OUT ? EPOLLOUT : 0);
+    ev.data.ptr = ptr;
+    return epoll_ctl(epfd, op, fd, &ev);
+}
+
+static int
+evAdd(int fd, int events, void *ptr) {
+    return evCtl(EPOLL_CTL_ADD, fd, events, ptr);
+}
+
+static int
+evMod(int fd, int events, void *ptr) {
+    return evCtl(EPOLL_CTL_MOD, fd, events, ptr);
+}
+
+static void
+evDel(int fd) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int
+evWait(ev_t *evs, int max, int timeout) {
+    struct epoll_event eevs[MAX_EVENTS];
+    if (max > MAX_EVENTS) max = MAX_EVENTS;
+
+    int n = epoll_wait(epfd, eevs, max, timeout);
+    for (int i = 0; i < n; i++) {
+        evs[i].ptr = eevs[i].data.ptr;
+        evs[i].events = (eevs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR) ?
+            EV_IN : 0) | (eevs[i].events & EPOLLOUT ? EV_OUT : 0);
+    }
+    return n;
+}
+#else
+static _Thread_local struct pollfd *pfds = NULL;
+static _Thread_local void **pptrs = NULL;
+static _Thread_local int npfds = 0, cappfds = 0;
+
+static int
+evInit(void) {
+    return 0;
+}
+
+static int
+evAdd(int fd, int events, void *ptr) {
+    if (npfds == cappfds) {
+        cappfds = cappfds ? cappfds * 2 : 64;
+        pfds = realloc(pfds, sizeof(struct pollfd) * cappfds);
+        pptrs = realloc(pptrs, sizeof(void*) * cappfds);
+    }
+    pfds[npfds].fd = fd;
+    pfds[npfds].events = (events & EV_IN ? POLLIN : 0) |
+        (events & EV_OUT ? POLLOUT : 0);
+    pptrs[npfds] = ptr;
+    npfds++;
+    return 0;
+}
+
+static int
+evMod(int fd, int events, void *ptr) {
+    for (int i = 0; i < npfds; i++)
+        if (pfds[i].fd == fd) {
+            pfds[i].events = (events & EV_IN ? POLLIN : 0) |
+                (events & EV_OUT ? POLLOUT : 0);
+            pptrs[i] = ptr;
+            return 0;
+        }
+    return -1;
+}
+
+static void
+evDel(int fd) {
+    for (int i = 0; i < npfds; i++)
+        if (pfds[i].fd == fd) {
+            pfds[i] = pfds[--npfds];
+            pptrs[i] = pptrs[npfds];
+            return;
+        }
+}
+
+static int
+evWait(ev_t *evs, int max, int timeout) {
+    int r = poll(pfds, npfds, timeout);
+    if (r <= 0)
+        return r;
+
+    int n = 0;
+    for (int i = 0; i < npfds && n < max; i++) {
+        if (!pfds[i].revents) continue;
+        evs[n].ptr = pptrs[i];
+        evs[n].events = (pfds[i].revents & (POLLIN | POLLHUP | POLLERR) ?
+            EV_IN : 0) | (pfds[i].revents & POLLOUT ? EV_OUT : 0);
+        n++;
+    }
+    return n;
+}
+#endif
+
+static int
+setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+typedef struct {
+    const char *p;
+    size_t len;
+    buf_t *buf;
+} seg_t;
+
+/* Per connection state machine */
+#define CONN_READING    0
+#define CONN_WRITING    1
+
+/* Result of handling input, besides 0 and -1 */
+#define CONN_MOVED      1
+
+typedef struct conn_s {
+    int fd;
+    uint32_t addr;      /* client IPv4, for the access log */
+    int state;
+    int closeAfter;     /* close once the queued output is sent */
+    time_t lastActive;
+    char in[RECV_SIZE];
+    size_t inLen;
+    http_req_t req;     /* request being parsed from in */
+    uint64_t start;     /* us, when the requests in were taken up */
+    /* Output queue, segments point into static data or a held buf_t */
+    seg_t *segs;
+    int segHead, segTail, segCap;
+    /* Board being streamed, chunked or up to the close, produced as the
+        queue drains */
+    int streaming, streamChunked, streamPhase, streamCell;
+    buf_t *chunk;
+    struct conn_s *prev, *next;     /* idle list, least recent first */
+    size_t outBytes;                /* queued and not yet sent */
+    int ws;                         /* websocket or event stream */
+    int sse;                        /* the latter */
+    int wsStale;                    /* skipped deltas, owed the board */
+    time_t staleSince;
+    struct conn_s *wsPrev, *wsNext; /* its session's push clients */
+    session_t *session;             /* held while streaming or pushed to */
+    uint64_t newSession;            /* to hand out in the next response */
+    char etag[48];                  /* board etag for the next response */
+    int encoding;                   /* and the coding of its body */
+    #ifdef HTTPD_URING
+    /* Requests in flight on the ring, it is only freed once none are */
+    int pending, recving, sending, linked, closing;
+    struct iovec iov[IOV_BATCH];    /* of the send in flight */
+    struct msghdr msg;
+    #endif
+} conn_t;
+
+static _Thread_local conn_t *idleHead = NULL, *idleTail = NULL;
+
+/* Routes requests are counted and timed by */
+#define ROUTE_PAGE      0
+#define ROUTE_STATE     1
+#define ROUTE_STATE_BIN 2
+#define ROUTE_MOVE      3
+#define ROUTE_WS        4
+#define ROUTE_EVENTS    5
+#define ROUTE_METRICS   6
+#define ROUTE_STATIC    7
+#define ROUTE_OTHER     8
+#define NROUTES         9
+
+static const char *routeNames[] = { "/", "/api/state", "/api/state.bin",
+    "/api/move", "/ws", "/events", "/metrics", "static", "other" };
+
+/* A reactor's counters, only written by it and summed on a scrape. Gauges
+    go up and down on whichever reactor the connection is on at the time,
+    only their sum means anything */
+typedef struct {
+    uint64_t requests[NROUTES][5];  /* by status class, 1xx to 5xx */
+    hist_t latency[NROUTES];
+    uint64_t moves;
+    uint64_t conns, pushClients, sessions;
+    uint64_t shed;                  /* connections turned away */
+} metrics_t;
+
+/* Reactor thread, connections for a game it does not own are handed over
+    to the owner through its pipe */
+typedef struct {
+    pthread_t thread;
+    int index;
+    int lfd;            /* its own SO_REUSEPORT listener */
+    int handoff[2];     /* conn_t pointers from other reactors */
+    metrics_t metrics;
+} reactor_t;
+
+static reactor_t *reactors = NULL;
+static int nreactors = 0;
+static _Thread_local reactor_t *self = NULL;
+
+/* Event pointers that are not connections */
+static char listenerTag, handoffTag;
+
+/* Access log record of c with no request in it, stamped now */
+static void
+accessRecord(access_rec_t *rec, const conn_t *c, const char *status) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    memset(rec, 0, offsetof(access_rec_t, target));
+    rec->time = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    rec->addr = c->addr;
+    rec->status = (status[0] - '0') * 100 + (status[1] - '0') * 10 +
+        (status[2] - '0');
+    rec->thread = self->index;
+}
+
+static int connWrite(conn_t *c);
+
+#ifdef HTTPD_URING
+/* Completion based backend instead of epoll, chosen at startup */
+static int useUring = 0;
+
+static int uringWrite(conn_t *c);
+static void uringClose(conn_t *c);
+#endif
+
+static time_t
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static uint64_t
+nowUs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+idleUnlink(conn_t *c) {
+    if (c->prev == NULL && idleHead != c)
+        return;
+    if (c->prev) c->prev->next = c->next; else idleHead = c->next;
+    if (c->next) c->next->prev = c->prev; else idleTail = c->prev;
+    c->prev = c->next = NULL;
+}
+
+/* Mark active, moving it to the back of the idle list. Push clients
+    are not on it, they wait for pushes as long as they like */
+static void
+idleTouch(conn_t *c) {
+    if (c->ws)
+        return;
+    if (idleTail != c) {
+        idleUnlink(c);
+        c->prev = idleTail;
+        if (idleTail) idleTail->next = c; else idleHead = c;
+        idleTail = c;
+    }
+    c->lastActive = now();
+}
+
+/* Select the session's game for everything that follows */
+static void
+sessionUse(session_t *s) {
+    cur = s;
+    gameSelect(s->game);
+    board = gameGetBoard();
+}
+
+/* After sessionNew or sessionExpire, which may have evicted the selected
+    session. Eviction unselects its game, cur must not outlive it either */
+static void
+sessionForgetEvicted(void) {
+    if (gameSelected() == NULL) {
+        cur = NULL;
+        board = NULL;
+    }
+}
+
+/* Take it off every list, nothing reaches it after this */
+static void
+connDetach(conn_t *c) {
+    idleUnlink(c);
+    if (c->ws) {
+        if (c->wsPrev) c->wsPrev->wsNext = c->wsNext;
+        else c->session->clients = c->wsNext;
+        if (c->wsNext) c->wsNext->wsPrev = c->wsPrev;
+        COUNTER_ADD(self->metrics.pushClients, -1);
+    }
+    if (c->session)
+        sessionUnref(c->session, now());
+}
+
+/* Count a new connection in, or answer it 503 and close it when at the
+    limit, returns -1 then. Shed ones cost no more than this: whatever
+    request already came is read and dropped, so closing does not reset
+    the connection before the client has the answer */
+static int
+connAdmit(int fd) {
+    if (__atomic_add_fetch(&openConns, 1, __ATOMIC_RELAXED) <= maxConns)
+        return 0;
+    __atomic_sub_fetch(&openConns, 1, __ATOMIC_RELAXED);
+
+    char drain[4096];
+    while (recv(fd, drain, sizeof(drain), MSG_DONTWAIT) > 0) ;
+    /* Fits the empty socket buffer, it goes whole or not at all */
+    send(fd, shedResponse, strlen(shedResponse), MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(fd);
+    COUNTER_ADD(self->metrics.shed, 1);
+    return -1;
+}
+
+static void
+connRelease(void) {
+    __atomic_sub_fetch(&openConns, 1, __ATOMIC_RELAXED);
+}
+
+static void
+connFree(conn_t *c) {
+    for (int i = c->segHead; i < c->segTail; i++)
+        bufUnref(c->segs[i].buf);
+    free(c->segs);
+    bufUnref(c->chunk);
+    free(c);
+    connRelease();
+    COUNTER_ADD(self->metrics.conns, -1);
+}
+
+static void
+connClose(conn_t *c) {
+    #ifdef HTTPD_URING
+    if (useUring) {
+        uringClose(c);
+        return;
+    }
+    #endif
+    connDetach(c);
+    evDel(c->fd);
+    close(c->fd);
+    connFree(c);
+}
+
+/* Close connections idle for too long, oldest first */
+static void
+closeIdle(void) {
+    time_t limit = now() - IDLE_TIMEOUT;
+    while (idleHead && idleHead->lastActive < limit)
+        connClose(idleHead);
+}
+
+/* Queue len bytes at p to be sent, holding a reference to buf if any */
+static void
+connQueue(conn_t *c, const char *p, size_t len, buf_t *buf) {
+    if (len == 0)
+        return;
+
+    if (c->segTail == c->segCap) {
+        /* Reclaim sent slots before growing */
+        if (c->segHead) {
+            memmove(c->segs, c->segs + c->segHead,
+                sizeof(seg_t) * (c->segTail - c->segHead));
+            c->segTail -= c->segHead;
+            c->segHead = 0;
+        }
+        if (c->segTail == c->segCap) {
+            int cap = c->segCap ? c->segCap * 2 : 16;
+            seg_t *segs = realloc(c->segs, sizeof(seg_t) * cap);
+            if (segs == NULL) {
+                /* The response is cut short, end it with the connection */
+                c->closeAfter = 1;
+                return;
+            }
+            c->segs = segs;
+            c->segCap = cap;
+        }
+    }
+
+    seg_t *seg = &c->segs[c->segTail++];
+    seg->p = p;
+    seg->len = len;
+    seg->buf = bufRef(buf);
+    c->outBytes += len;
+}
+
+/* Public id of a session, which spectators may know without being able to
+    play. A keyed Feistel network over the halves, so it maps back */
+static uint32_t
+watchRound(uint32_t half, uint32_t key) {
+    uint64_t x = ((uint64_t)half << 32 | key) + 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return (uint32_t)(x ^ (x >> 31));
+}
+
+static uint64_t
+watchId(uint64_t id) {
+    uint32_t l = id >> 32, r = (uint32_t)id, t;
+    for (int i = 0; i < 4; i++) {
+        t = r;
+        r = l ^ watchRound(r, watchKey[i]);
+        l = t;
+    }
+    return (uint64_t)l << 32 | r;
+}
+
+static uint64_t
+watchSessionId(uint64_t watch) {
+    uint32_t l = watch >> 32, r = (uint32_t)watch, t;
+    for (int i = 3; i >= 0; i--) {
+        t = l;
+        l = r ^ watchRound(l, watchKey[i]);
+        r = t;
+    }
+    return (uint64_t)l << 32 | r;
+}
+
+/* Headers that go with the next response only */
+/* Board version as the etag of the next response, with the game and run
+    it belongs to, and the coding since each is its own representation.
+    By its public id, players and spectators see the same etag */
+static void
+boardEtag(conn_t *c) {
+    if (c->encoding)
+        snprintf(c->etag, sizeof(c->etag), "\"%x.%llx.%x.%s\"", bootId,
+            (unsigned long long)watchId(cur->id), gameGetVersion(),
+            encodingNames[c->encoding]);
+    else
+        snprintf(c->etag, sizeof(c->etag), "\"%x.%llx.%x\"", bootId,
+            (unsigned long long)watchId(cur->id), gameGetVersion());
+}
+
+static void
+extraHeaders(conn_t *c, char *buff, size_t len) {
+    size_t n = 0;
+    buff[0] = '\0';
+    if (c->newSession) {
+        n = snprintf(buff, len, cookieHeader,
+            (unsigned long long)c->newSession);
+        c->newSession = 0;
+    }
+    if (c->etag[0]) {
+        n += snprintf(buff + n, len - n, versionHeaders, c->etag);
+        c->etag[0] = '\0';
+    }
+    if (c->encoding) {
+        snprintf(buff + n, len - n, encodingHeader,
+            encodingNames[c->encoding]);
+        c->encoding = ENC_IDENTITY;
+    }
+}
+
+/* Queue the status line and headers of a response of len bytes, or
+    LEN_CHUNKED or LEN_UNTIL_CLOSE. Returns -1 if there is no memory even for them, the
+    connection is then closed after what is already queued */
+static int
+queueHeaders(conn_t *c, const char *status, const char *type, size_t len) {
+    const char *conn = c->closeAfter ? "close" : "keep-alive";
+    char extra[256];
+    extraHeaders(c, extra, sizeof(extra));
+
+    buf_t *h = bufNew(512);
+    if (h == NULL) {
+        c->closeAfter = 1;
+        return -1;
+    }
+    if (len == LEN_CHUNKED)
+        h->len = snprintf(h->data, h->cap, chunkedHeaders, status, type, conn,
+            extra);
+    else if (len == LEN_UNTIL_CLOSE)
+        h->len = snprintf(h->data, h->cap, untilCloseHeaders, status, type,
+            extra);
+    else
+        h->len = snprintf(h->data, h->cap, responseHeaders, status, type, len,
+            conn, extra);
+    connQueue(c, h->data, h->len, h);
+    bufUnref(h);
+    return 0;
+}
+
+/* Queue a complete response, pipelined responses go out in order. The body
+    is not copied, it must outlive the connection */
+static void
+respond(conn_t *c, const char *status, const char *type,
+    const char *body, size_t len)
+{
+    if (queueHeaders(c, status, type, len) == 0)
+        connQueue(c, body, len, NULL);
+}
+
+/* Queue a complete response with a body of its own */
+static void
+respondBuf(conn_t *c, const char *status, const char *type, buf_t *body) {
+    if (queueHeaders(c, status, type, body->len) == 0)
+        connQueue(c, body->data, body->len, body);
+}
+
+static const asset_t *
+assetFind(slice_t path) {
+    for (size_t i = 0; i < NASSETS; i++)
+        if (sliceEq(path, assets[i].path))
+            return &assets[i];
+    return NULL;
+}
+
+/* One segment, sent as is, returns the status for the log */
+static const char *
+respondAsset(conn_t *c, const asset_t *a) {
+    int notModified = httpIfNoneMatch(&c->req, a->etag);
+    const buf_t *b = notModified ?
+        a->notModified[c->closeAfter] : a->ok[c->closeAfter];
+    connQueue(c, b->data, b->len, NULL);
+    return notModified ? "304 Not Modified" : "200 OK";
+}
+
+static void
+respondOom(conn_t *c) {
+    c->closeAfter = 1;
+    c->etag[0] = '\0';
+    c->encoding = ENC_IDENTITY;
+    respond(c, "503 Service Unavailable", "text/plain",
+        "Out of memory\n", 14);
+}
+
+/* Big boards go in constant memory, never rendered whole, compressed or
+    cached. HTTP/1.0 clients get them up to the close instead of chunked */
+static int
+boardStreams(void) {
+    return size * size > STREAM_CELLS;
+}
+
+/* Encoded board responses and frames, kept until the board changes so
+    repeated fetches and every watcher share one encoding pass. Direct
+    mapped on session, kind and coding, a newer version takes the slot */
+#define VCACHE_BITS     6
+#define VC_PAGE         0
+#define VC_STATE        1
+#define VC_WS_STATE     2
+#define VC_SSE_STATE    3
+
+typedef struct {
+    uint64_t id;
+    unsigned int version;
+    int kind, encoding;
+    buf_t *body;
+} vcache_t;
+
+static _Thread_local vcache_t vcache[1 << VCACHE_BITS];
+
+static vcache_t *
+vcacheSlot(int kind, int encoding) {
+    uint64_t h = (cur->id ^ (uint64_t)(kind << 2 | encoding)) *
+        0x9e3779b97f4a7c15ULL;
+    return &vcache[h >> (64 - VCACHE_BITS)];
+}
+
+static buf_t *
+vcacheFind(int kind, int encoding) {
+    vcache_t *z = vcacheSlot(kind, encoding);
+    if (z->body && z->id == cur->id && z->kind == kind &&
+        z->encoding == encoding && z->version == gameGetVersion())
+            return z->body;
+    return NULL;
+}
+
+static void
+vcacheStore(int kind, int encoding, buf_t *body) {
+    vcache_t *z = vcacheSlot(kind, encoding);
+    bufUnref(z->body);
+    z->id = cur->id;
+    z->version = gameGetVersion();
+    z->kind = kind;
+    z->encoding = encoding;
+    z->body = bufRef(body);
+}
+
+#ifdef HTTPD_COMPRESS
+/* Best coding the client takes for this board response, identity for
+    streamed boards and anything else */
+static int
+boardEncoding(conn_t *c) {
+    slice_t path = c->req.path;
+    if (!sliceEq(path, "/api/state") &&
+        (!sliceEq(path, "/") || boardStreams()))
+            return ENC_IDENTITY;
+
+    #ifdef HTTPD_BROTLI
+    if (httpAcceptsEncoding(&c->req, "br"))
+        return ENC_BR;
+    #endif
+    #ifdef HTTPD_ZLIB
+    if (httpAcceptsEncoding(&c->req, "gzip"))
+        return ENC_GZIP;
+    if (httpAcceptsEncoding(&c->req, "deflate"))
+        return ENC_DEFLATE;
+    #endif
+    return ENC_IDENTITY;
+}
+
+#ifdef HTTPD_ZLIB
+static buf_t *
+zlibBody(const slice_t *parts, int n, size_t total, int gzip) {
+    z_stream z = { 0 };
+    /* 16 more window bits for a gzip wrapper instead of a zlib one */
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+        gzip ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return NULL;
+
+    buf_t *b = bufNew(deflateBound(&z, total));
+    int r = Z_OK;
+    if (b) {
+        z.next_out = (Bytef*)b->data;
+        z.avail_out = b->cap;
+        for (int i = 0; i < n && r == Z_OK; i++) {
+            /* Nothing to take is an error short of the end */
+            if (parts[i].len == 0 && i < n - 1)
+                continue;
+            z.next_in = (Bytef*)parts[i].p;
+            z.avail_in = parts[i].len;
+            r = deflate(&z, i == n - 1 ? Z_FINISH : Z_NO_FLUSH);
+        }
+        b->len = z.total_out;
+    }
+    deflateEnd(&z);
+
+    if (r != Z_STREAM_END) {
+        bufUnref(b);
+        return NULL;
+    }
+    return b;
+}
+#endif
+
+#ifdef HTTPD_BROTLI
+static buf_t *
+brotliBody(const slice_t *parts, int n, size_t total) {
+    size_t cap = BrotliEncoderMaxCompressedSize(total);
+    BrotliEncoderState *s = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+    buf_t *b = cap ? bufNew(cap) : NULL;
+    if (s == NULL || b == NULL) {
+        if (s) BrotliEncoderDestroyInstance(s);
+        bufUnref(b);
+        return NULL;
+    }
+    BrotliEncoderSetParameter(s, BROTLI_PARAM_QUALITY, 5);
+    BrotliEncoderSetParameter(s, BROTLI_PARAM_MODE, BROTLI_MODE_TEXT);
+    BrotliEncoderSetParameter(s, BROTLI_PARAM_SIZE_HINT, total);
+
+    size_t availIn, availOut = cap;
+    const uint8_t *in;
+    uint8_t *out = (uint8_t*)b->data;
+    int ok = 1;
+    for (int i = 0; i < n && ok; i++) {
+        availIn = parts[i].len;
+        in = (const uint8_t*)parts[i].p;
+        while (ok && availIn && availOut)
+            ok = BrotliEncoderCompressStream(s, BROTLI_OPERATION_PROCESS,
+                &availIn, &in, &availOut, &out, NULL);
+    }
+    availIn = 0;
+    while (ok && availOut && !BrotliEncoderIsFinished(s))
+        ok = BrotliEncoderCompressStream(s, BROTLI_OPERATION_FINISH,
+            &availIn, &in, &availOut, &out, NULL);
+    ok = ok && BrotliEncoderIsFinished(s);
+    BrotliEncoderDestroyInstance(s);
+
+    if (!ok) {
+        bufUnref(b);
+        return NULL;
+    }
+    b->len = cap - availOut;
+    return b;
+}
+#endif
+
+/* Give back the capacity past len, only while nothing else holds it */
+static buf_t *
+bufShrink(buf_t *b) {
+    buf_t *s = realloc(b, sizeof(buf_t) + b->len);
+    if (s == NULL)
+        return b;
+    s->cap = s->len;
+    return s;
+}
+
+/* Compress the body pieces in one pass, the result only as big as it
+    needs to be since the cache keeps it. NULL if that failed */
+static buf_t *
+compressBody(const slice_t *parts, int n, int encoding) {
+    size_t total = 0;
+    for (int i = 0; i < n; i++)
+        total += parts[i].len;
+
+    buf_t *b = NULL;
+    #ifdef HTTPD_BROTLI
+    if (encoding == ENC_BR)
+        b = brotliBody(parts, n, total);
+    #endif
+    #ifdef HTTPD_ZLIB
+    if (encoding == ENC_GZIP || encoding == ENC_DEFLATE)
+        b = zlibBody(parts, n, total, encoding == ENC_GZIP);
+    #endif
+    return b ? bufShrink(b) : NULL;
+}
+
+/* Send the cached body of kind if the board has not changed since */
+static int
+respondCached(conn_t *c, int kind, const char *type) {
+    buf_t *z;
+    if (c->encoding == ENC_IDENTITY ||
+        (z = vcacheFind(kind, c->encoding)) == NULL)
+            return 0;
+    respondBuf(c, "200 OK", type, z);
+    return 1;
+}
+
+/* Compress, cache and send, falling back to identity */
+static int
+respondCompressed(conn_t *c, int kind, const char *type,
+    const slice_t *parts, int n)
+{
+    if (c->encoding == ENC_IDENTITY)
+        return 0;
+
+    buf_t *z = compressBody(parts, n, c->encoding);
+    if (z == NULL) {
+        c->encoding = ENC_IDENTITY;
+        boardEtag(c);
+        return 0;
+    }
+    vcacheStore(kind, c->encoding, z);
+    respondBuf(c, "200 OK", type, z);
+    bufUnref(z);
+    return 1;
+}
 #endif
 
-#include <pthread.h>
+/* Flags left in decimal at the end of buff, returns where it starts */
+static char *
+flagsText(char *end) {
+    int flagsLeft = gameGetFlagsLeft();
+    if (flagsLeft >= 0)
+        return utoa10(flagsLeft, end);
+    char *p = utoa10(-flagsLeft, end);
+    *--p = '-';
+    return p;
+}
+
+static const char *
+alertText(void) {
+    switch (gameGetState()) {
+    case STATE_LOST: return alertLost;
+    case STATE_WON: return alertWon;
+    }
+    return "";
+}
+
+#define STREAM_HEAD     0
+#define STREAM_ROWS     1
+#define STREAM_TAIL     2
+#define STREAM_DONE     3
+
+/* Chunk framing: fixed width hex size line so it is written last */
+#define CHUNK_HDR       10  /* "%08zx\r\n" */
+#define CHUNK_TRAILER   7   /* "\r\n" "0\r\n\r\n" */
+
+static char *
+copySlice(char *o, const char *p, size_t len) {
+    memcpy(o, p, len);
+    return o + len;
+}
+
+/* Produce and queue the next chunk of a streamed board, reusing the one
+    chunk buffer. The board may change between chunks, each cell is
+    rendered as it is when its chunk is produced. Unchunked streams use
+    the whole buffer and end with the connection */
+static void
+streamNext(conn_t *c) {
+    sessionUse(c->session);
+
+    buf_t *b = c->chunk;
+    int framed = c->streamChunked;
+    char *start = b->data + (framed ? CHUNK_HDR : 0), *o = start;
+    const char *end = b->data + b->cap - (framed ? CHUNK_TRAILER : 0);
+
+    if (c->streamPhase == STREAM_HEAD) {
+        char flagsBuff[12];
+        char *flagsEnd = flagsBuff + sizeof(flagsBuff);
+        char *flags = flagsText(flagsEnd);
+        o = copySlice(o, tpl[TPL_HEAD].p, tpl[TPL_HEAD].len);
+        o = copySlice(o, flags, flagsEnd - flags);
+        o = copySlice(o, tpl[TPL_PRE_BOARD].p, tpl[TPL_PRE_BOARD].len);
+        c->streamPhase = STREAM_ROWS;
+    }
+
+    if (c->streamPhase == STREAM_ROWS) {
+        o = renderCells(o, end, &c->streamCell);
+        if (c->streamCell == size * size)
+            c->streamPhase = STREAM_TAIL;
+    }
+
+    if (c->streamPhase == STREAM_TAIL) {
+        const char *alert = alertText();
+        size_t alertLen = strlen(alert);
+        if ((size_t)(end - o) >=
+            tpl[TPL_PRE_SCRIPT].len + alertLen + tpl[TPL_TAIL].len)
+        {
+            o = copySlice(o, tpl[TPL_PRE_SCRIPT].p, tpl[TPL_PRE_SCRIPT].len);
+            o = copySlice(o, alert, alertLen);
+            o = copySlice(o, tpl[TPL_TAIL].p, tpl[TPL_TAIL].len);
+            c->streamPhase = STREAM_DONE;
+        }
+    }
+
+    /* Frame it, the last one carries the terminating chunk */
+    if (framed) {
+        char hex[CHUNK_HDR + 1];
+        snprintf(hex, sizeof(hex), "%08zx\r\n", (size_t)(o - start));
+        memcpy(b->data, hex, CHUNK_HDR);
+        o = copySlice(o, "\r\n", 2);
+        if (c->streamPhase == STREAM_DONE)
+            o = copySlice(o, "0\r\n\r\n", 5);
+    }
+    if (c->streamPhase == STREAM_DONE) {
+        c->streaming = 0;
+        sessionUnref(c->session, now());
+        c->session = NULL;
+    }
+
+    b->len = o - b->data;
+    connQueue(c, b->data, b->len, b);
+}
+
+/* Start streaming the board, chunks are produced as the socket drains */
+static void
+streamBoard(conn_t *c) {
+    if (c->chunk == NULL && (c->chunk = bufNew(STREAM_CHUNK)) == NULL) {
+        respondOom(c);
+        return;
+    }
+
+    /* HTTP/1.0 has no chunks, the close ends the body */
+    c->streamChunked = c->req.minor >= 1;
+    if (!c->streamChunked)
+        c->closeAfter = 1;
+    if (queueHeaders(c, "200 OK", "text/html",
+        c->streamChunked ? LEN_CHUNKED : LEN_UNTIL_CLOSE) < 0)
+            return;
+    c->session = cur;
+    sessionRef(cur);
+    c->streaming = 1;
+    c->streamPhase = STREAM_HEAD;
+    c->streamCell = 0;
+}
+
+/* Board page: the static template pieces around a fresh render */
+static void
+respondBoard(conn_t *c) {
+    if (boardStreams()) {
+        streamBoard(c);
+        return;
+    }
+
+    #ifdef HTTPD_COMPRESS
+    if (respondCached(c, VC_PAGE, "text/html"))
+        return;
+    #endif
+
+    buf_t *rows = renderBoard();
+    if (rows == NULL) {
+        respondOom(c);
+        return;
+    }
+
+    /* Copied, the queue outlives this stack frame */
+    buf_t *num = bufNew(12);
+    if (num == NULL) {
+        bufUnref(rows);
+        respondOom(c);
+        return;
+    }
+    char flagsBuff[12];
+    char *flagsEnd = flagsBuff + sizeof(flagsBuff);
+    char *flags = flagsText(flagsEnd);
+    bufAppend(num, flags, flagsEnd - flags);
+
+    const char *alert = alertText();
+
+    slice_t parts[] = {
+        tpl[TPL_HEAD], { num->data, num->len }, tpl[TPL_PRE_BOARD],
+        { rows->data, rows->len }, tpl[TPL_PRE_SCRIPT],
+        { alert, strlen(alert) }, tpl[TPL_TAIL]
+    };
+    buf_t *holds[] = { NULL, num, NULL, rows, NULL, NULL, NULL };
+    int nparts = sizeof(parts) / sizeof(parts[0]);
+
+    #ifdef HTTPD_COMPRESS
+    if (respondCompressed(c, VC_PAGE, "text/html", parts, nparts)) {
+        bufUnref(num);
+        bufUnref(rows);
+        return;
+    }
+    #endif
+
+    size_t len = 0;
+    for (int i = 0; i < nparts; i++)
+        len += parts[i].len;
+    if (queueHeaders(c, "200 OK", "text/html", len) == 0)
+        for (int i = 0; i < nparts; i++)
+            connQueue(c, parts[i].p, parts[i].len, holds[i]);
+
+    bufUnref(num);
+    bufUnref(rows);
+}
+
+/* Board state API, every encoding shares the same cell codes */
+#define CODE_HIDDEN     9   /* 0-8 cleared, with that many mines around */
+#define CODE_FLAG       10
+#define CODE_MINE       11  /* only once the game is over */
+
+static const char *stateNames[] = { "playing", "lost", "won" };
+
+static int
+cellCode(int i, int over) {
+    int cell = board[i];
+    if (CHECK_CLEAR(cell))
+        return gameGetSurroundingMines(i % size, i / size);
+    if (CHECK_FLAG(cell))
+        return CODE_FLAG;
+    if (over && CHECK_MINE(cell))
+        return CODE_MINE;
+    return CODE_HIDDEN;
+}
+
+/* Counters every API response starts with, returns the length. With
+    sessions, the id to spectate the game by too */
+static int
+stateCounters(char *o, size_t len) {
+    int n = snprintf(o, len,
+        "{\"version\":%u,\"size\":%d,\"flagsLeft\":%d,\"state\":\"%s\"",
+        gameGetVersion(), size, gameGetFlagsLeft(),
+        stateNames[gameGetState()]);
+    if (sessionMem)
+        n += snprintf(o + n, len - n, ",\"watch\":\"%016llx\"",
+            (unsigned long long)watchId(cur->id));
+    return n;
+}
+
+/* /api/state: counters and a string of one hex cell code per cell */
+static void
+respondStateJson(conn_t *c) {
+    #ifdef HTTPD_COMPRESS
+    if (respondCached(c, VC_STATE, "application/json"))
+        return;
+    #endif
+
+    int cells = size * size, over = gameGetState() != STATE_GOING;
+    buf_t *b = bufNew((size_t)cells + 128);
+    if (b == NULL) {
+        respondOom(c);
+        return;
+    }
+
+    b->len = stateCounters(b->data, b->cap);
+    bufAppend(b, ",\"cells\":\"", 10);
+    for (int i = 0; i < cells; i++)
+        b->data[b->len++] = "0123456789abcdef"[cellCode(i, over)];
+    bufAppend(b, "\"}\n", 3);
+
+    #ifdef HTTPD_COMPRESS
+    slice_t body = { b->data, b->len };
+    if (respondCompressed(c, VC_STATE, "application/json", &body, 1)) {
+        bufUnref(b);
+        return;
+    }
+    #endif
+
+    respondBuf(c, "200 OK", "application/json", b);
+    bufUnref(b);
+}
+
+static char *
+put32(char *o, uint32_t v) {
+    o[0] = v; o[1] = v >> 8; o[2] = v >> 16; o[3] = v >> 24;
+    return o + 4;
+}
+
+/* /api/state.bin, little endian: u32 version, u32 size, i32 flagsLeft,
+    u32 state, then a 4 bit code per cell, even cells in the low nibble */
+#define STATE_BIN_HDR   16
+#define STATE_BIN_SIZE  (STATE_BIN_HDR + ((size_t)size * size + 1) / 2)
+
+static char *
+stateBinHeader(char *o) {
+    o = put32(o, gameGetVersion());
+    o = put32(o, size);
+    o = put32(o, gameGetFlagsLeft());
+    return put32(o, gameGetState());
+}
+
+static char *
+stateBin(char *o) {
+    int cells = size * size, over = gameGetState() != STATE_GOING;
+    o = stateBinHeader(o);
+    for (int i = 0; i < cells; i += 2)
+        *o++ = cellCode(i, over) |
+            (i + 1 < cells ? cellCode(i + 1, over) << 4 : 0);
+    return o;
+}
+
+static void
+respondStateBin(conn_t *c) {
+    buf_t *b = bufNew(STATE_BIN_SIZE);
+    if (b == NULL) {
+        respondOom(c);
+        return;
+    }
+
+    b->len = stateBin(b->data) - b->data;
+    respondBuf(c, "200 OK", "application/octet-stream", b);
+    bufUnref(b);
+}
+
+/* Websocket messages are binary, a type byte and then
+    WS_MSG_STATE: the /api/state.bin payload
+    WS_MSG_DELTA: the /api/state.bin header, then a u32 index << 4 | code
+        for each cell the move changed
+    Event streams get the same payload in base64, as the data of a "delta"
+    event, or of a "playing", "lost" or "won" one for the whole board */
+#define WS_MSG_STATE    0
+#define WS_MSG_DELTA    1
+
+static buf_t *
+wsFrameNew(int op, size_t len) {
+    buf_t *f = bufNew(WS_HDR_MAX + len);
+    if (f != NULL)
+        f->len = wsHeader(f->data, op, len);
+    return f;
+}
+
+/* Whole board, built once per version however many clients join or fall
+    behind, returns a reference */
+static buf_t *
+wsStateFrame(void) {
+    buf_t *f = vcacheFind(VC_WS_STATE, ENC_IDENTITY);
+    if (f != NULL)
+        return bufRef(f);
+
+    f = wsFrameNew(WS_OP_BINARY, 1 + STATE_BIN_SIZE);
+    if (f == NULL)
+        return NULL;
+
+    char *o = f->data + f->len;
+    *o++ = WS_MSG_STATE;
+    f->len = stateBin(o) - f->data;
+    vcacheStore(VC_WS_STATE, ENC_IDENTITY, f);
+    return f;
+}
+
+static buf_t *
+wsDeltaFrame(const int *changes, int n) {
+    buf_t *f = wsFrameNew(WS_OP_BINARY, 1 + STATE_BIN_HDR + 4 * (size_t)n);
+    if (f == NULL)
+        return NULL;
+
+    char *o = f->data + f->len;
+    *o++ = WS_MSG_DELTA;
+    o = stateBinHeader(o);
+    for (int i = 0; i < n; i++)
+        o = put32(o, (uint32_t)changes[i] << 4 | cellCode(changes[i], 0));
+    f->len = o - f->data;
+    return f;
+}
+
+/* Event carrying the payload of a websocket frame, its last len bytes */
+static buf_t *
+sseFrame(const buf_t *ws, size_t len) {
+    const char *p = ws->data + ws->len - len;
+    const char *event = p[0] == WS_MSG_DELTA ? "delta" :
+        stateNames[gameGetState()];
+    buf_t *f = bufNew(64 + BASE64_LEN(len));
+    if (f == NULL)
+        return NULL;
+
+    f->len = snprintf(f->data, f->cap, "event: %s\nid: %u\ndata: ", event,
+        gameGetVersion());
+    f->len += base64Encode(f->data + f->len, p, len);
+    bufAppend(f, "\n\n", 2);
+    return f;
+}
+
+/* Whole board for either kind of client, returns a reference */
+static buf_t *
+pushStateFrame(int sse) {
+    buf_t *ws = wsStateFrame();
+    if (!sse || ws == NULL)
+        return ws;
+
+    buf_t *f = vcacheFind(VC_SSE_STATE, ENC_IDENTITY);
+    if (f != NULL)
+        f = bufRef(f);
+    else if ((f = sseFrame(ws, 1 + STATE_BIN_SIZE)) != NULL)
+        vcacheStore(VC_SSE_STATE, ENC_IDENTITY, f);
+    bufUnref(ws);
+    return f;
+}
+
+/* Queue a frame to every websocket and event stream client. The frame is
+    shared, built once for each kind whatever the number of clients. Clients
+    too far behind skip it, and get the whole board once they drain rather
+    than every delta they missed */
+static void
+pushBroadcast(void) {
+    if (cur->clients == NULL)
+        return;
+
+    /* Losing reveals mines, too many changes to list, send it all */
+    int n, whole;
+    const int *changes = gameGetChanges(&n);
+    whole = changes == NULL || gameGetState() != STATE_GOING;
+    buf_t *frames[2] = { NULL, NULL };
+    frames[0] = whole ? wsStateFrame() : wsDeltaFrame(changes, n);
+    if (frames[0] == NULL) {
+        printf("Warning: No memory for a websocket frame\n");
+        return;
+    }
+
+    conn_t *next;
+    for (conn_t *c = cur->clients; c; c = next) {
+        next = c->wsNext;
+        if (c->wsStale || c->outBytes > WS_QUEUE_MAX) {
+            if (!c->wsStale) {
+                c->wsStale = 1;
+                c->staleSince = now();
+            }
+            else if (now() - c->staleSince > WS_STALE_TIMEOUT) {
+                /* Logged as a timeout of its push stream */
+                access_rec_t rec;
+                accessRecord(&rec, c, "408 Request Timeout");
+                memcpy(rec.method, c->sse ? "SSE" : "WS", c->sse ? 3 : 2);
+                accessLog(&rec);
+                connClose(c);
+            }
+            continue;
+        }
+
+        /* Event stream frames from the websocket one, once needed */
+        buf_t *f = frames[c->sse];
+        if (f == NULL) {
+            f = frames[1] = whole ? pushStateFrame(1) :
+                sseFrame(frames[0], 1 + STATE_BIN_HDR + 4 * (size_t)n);
+            if (f == NULL) {
+                connClose(c);
+                continue;
+            }
+        }
+        connQueue(c, f->data, f->len, f);
+        if (connWrite(c) < 0)
+            connClose(c);
+    }
+    bufUnref(frames[0]);
+    bufUnref(frames[1]);
+}
+
+/* Every move goes through here, so push clients see it */
+static void
+moveCell(void (*op)(int, int), int cell) {
+    unsigned int version = gameGetVersion();
+    op(cell % size, cell / size);
+    if (gameGetVersion() != version) {
+        COUNTER_ADD(self->metrics.moves, 1);
+        pushBroadcast();
+    }
+}
+
+/* Queue a control frame with a copy of its payload */
+static void
+wsSend(conn_t *c, int op, const char *payload, size_t len) {
+    buf_t *f = wsFrameNew(op, len);
+    if (f == NULL) {
+        c->closeAfter = 1;
+        return;
+    }
+    bufAppend(f, payload, len);
+    connQueue(c, f->data, f->len, f);
+    bufUnref(f);
+}
+
+/* Catch up a client that skipped deltas with the board as it is now. Its
+    game may not be the one selected */
+static void
+pushResync(conn_t *c) {
+    /* NULL if its session was evicted since, see sessionForgetEvicted */
+    session_t *prev = cur;
+    sessionUse(c->session);
+    buf_t *f = pushStateFrame(c->sse);
+    if (prev != NULL)
+        sessionUse(prev);
+    /* Try again on the next drain */
+    if (f == NULL)
+        return;
+
+    c->wsStale = 0;
+    connQueue(c, f->data, f->len, f);
+    bufUnref(f);
+}
+
+static void
+wsClose(conn_t *c, int code) {
+    char status[2] = { code >> 8, code & 0xff };
+    wsSend(c, WS_OP_CLOSE, status, 2);
+    c->closeAfter = 1;
+}
+
+/* Keep the connection open for the session's pushes, off the idle list */
+static void
+pushJoin(conn_t *c) {
+    c->closeAfter = 0;
+    idleUnlink(c);
+    c->ws = 1;
+    COUNTER_ADD(self->metrics.pushClients, 1);
+    c->session = cur;
+    sessionRef(cur);
+    c->wsPrev = NULL;
+    c->wsNext = cur->clients;
+    if (cur->clients) cur->clients->wsPrev = c;
+    cur->clients = c;
+}
+
+/* Switch the connection to websocket, it starts with the whole board and
+    then gets a delta after every move */
+static void
+wsUpgrade(conn_t *c) {
+    const http_req_t *r = &c->req;
+    const slice_t *key = httpHeader(r, "Sec-WebSocket-Key");
+    const slice_t *version = httpHeader(r, "Sec-WebSocket-Version");
+
+    if (r->minor < 1 || key == NULL || version == NULL ||
+        !sliceEq(*version, "13") ||
+        !httpHeaderHasToken(r, "Upgrade", "websocket") ||
+        !httpHeaderHasToken(r, "Connection", "Upgrade"))
+    {
+        respond(c, "400 Bad Request", "text/plain", "Bad Request\n", 12);
+        return;
+    }
+
+    buf_t *f = wsStateFrame();
+    if (f == NULL) {
+        respondOom(c);
+        return;
+    }
+
+    buf_t *h = bufNew(384);
+    if (h == NULL) {
+        bufUnref(f);
+        respondOom(c);
+        return;
+    }
+
+    char accept[WS_ACCEPT_LEN + 1], extra[128];
+    wsAccept(key->p, key->len, accept);
+    extraHeaders(c, extra, sizeof(extra));
+    h->len = snprintf(h->data, h->cap, wsHeaders, accept, extra);
+    connQueue(c, h->data, h->len, h);
+    connQueue(c, f->data, f->len, f);
+    bufUnref(h);
+    bufUnref(f);
+    pushJoin(c);
+}
+
+/* /events, the same pushes as server-sent events for clients that cannot
+    use a websocket. Whatever they send after the request is ignored */
+static void
+respondEvents(conn_t *c) {
+    buf_t *f = pushStateFrame(1);
+    if (f == NULL) {
+        respondOom(c);
+        return;
+    }
+
+    buf_t *h = bufNew(384);
+    if (h == NULL) {
+        bufUnref(f);
+        respondOom(c);
+        return;
+    }
+
+    char extra[128];
+    extraHeaders(c, extra, sizeof(extra));
+    h->len = snprintf(h->data, h->cap, eventsHeaders, extra);
+    connQueue(c, h->data, h->len, h);
+    connQueue(c, f->data, f->len, f);
+    bufUnref(h);
+    bufUnref(f);
+
+    c->sse = 1;
+    pushJoin(c);
+}
+
+/* Handle every complete frame buffered. Moves go through /api/move, data
+    frames are ignored */
+static void
+wsInput(conn_t *c) {
+    size_t off = 0;
+
+    while (!c->closeAfter) {
+        ws_frame_t f;
+        int r = wsParse(c->in + off, c->inLen - off, &f);
+        if (r == WS_PARSE_PARTIAL) {
+            /* Full and not one complete frame in it */
+            if (off == 0 && c->inLen == RECV_SIZE)
+                wsClose(c, 1009);
+            break;
+        }
+        if (r == WS_PARSE_ERROR) {
+            wsClose(c, 1002);
+            break;
+        }
+
+        if (f.op == WS_OP_PING)
+            wsSend(c, WS_OP_PONG, f.payload, f.len);
+        else if (f.op == WS_OP_CLOSE) {
+            /* Echo the status code back and hang up */
+            wsSend(c, WS_OP_CLOSE, f.payload, f.len < 2 ? f.len : 2);
+            c->closeAfter = 1;
+        }
+        off += f.size;
+    }
+
+    memmove(c->in, c->in + off, c->inLen - off);
+    c->inLen -= off;
+}
+
+/* /api/move: every clear, flag or chord parameter in order, checked all
+    before any is applied. Up to HTTP_MAX_PARAMS moves per request */
+static void
+respondMove(conn_t *c) {
+    const http_req_t *r = &c->req;
+    void (*ops[HTTP_MAX_PARAMS])(int, int);
+    int cells[HTTP_MAX_PARAMS], n = 0;
+
+    for (int i = 0; i < r->nparams; i++) {
+        const http_pair_t *p = &r->params[i];
+        if (sliceEq(p->name, "clear")) ops[n] = gameClearCell;
+        else if (sliceEq(p->name, "flag")) ops[n] = gameFlagCell;
+        else if (sliceEq(p->name, "chord")) ops[n] = gameChordCell;
+        else continue;
+
+        if (sliceInt(p->value, &cells[n]) < 0 || cells[n] >= size * size) {
+            respond(c, "400 Bad Request", "text/plain", "Bad move\n", 9);
+            return;
+        }
+        n++;
+    }
+
+    for (int i = 0; i < n && gameGetState() == STATE_GOING; i++)
+        moveCell(ops[i], cells[i]);
+
+    buf_t *b = bufNew(128);
+    if (b == NULL) {
+        respondOom(c);
+        return;
+    }
+    b->len = stateCounters(b->data, b->cap);
+    bufAppend(b, "}\n", 2);
+    respondBuf(c, "200 OK", "application/json", b);
+    bufUnref(b);
+}
+
+/* Apply a move parameter if present */
+static void
+applyMove(const http_req_t *r) {
+    int btni = 0;
+    if (httpParamInt(r, "clear", &btni) == 0 && btni < size * size)
+        moveCell(gameClearCell, btni);
+    else if (httpParamInt(r, "flag", &btni) == 0 && btni < size * size)
+        moveCell(gameFlagCell, btni);
+    else if (httpParamInt(r, "chord", &btni) == 0 && btni < size * size)
+        moveCell(gameChordCell, btni);
+}
+
+/* Paths that play or show a game, and so need a session */
+static int
+isGamePath(slice_t path) {
+    return sliceEq(path, "/") || sliceEq(path, "/api/state") ||
+        sliceEq(path, "/api/state.bin") || sliceEq(path, "/api/move") ||
+        sliceEq(path, "/ws") || sliceEq(path, "/events");
+}
+
+/* Responses drawn from nothing but the board */
+static int
+isBoardView(slice_t path) {
+    return sliceEq(path, "/") || sliceEq(path, "/api/state") ||
+        sliceEq(path, "/api/state.bin");
+}
+
+/* Tag the board response with its version, or answer 304 without
+    rendering anything if the client has it already. Returns 1 if it did */
+static int
+respondNotModified(conn_t *c) {
+    #ifdef HTTPD_COMPRESS
+    c->encoding = boardEncoding(c);
+    #endif
+    boardEtag(c);
+    if (!httpIfNoneMatch(&c->req, c->etag))
+        return 0;
+
+    /* Short of memory for the headers, answer in full then */
+    buf_t *h = bufNew(512);
+    if (h == NULL)
+        return 0;
+
+    /* No body to code */
+    c->encoding = ENC_IDENTITY;
+
+    const char *conn = c->closeAfter ? "close" : "keep-alive";
+    char extra[256];
+    extraHeaders(c, extra, sizeof(extra));
+    h->len = snprintf(h->data, h->cap, notModifiedHeaders, conn, extra);
+    connQueue(c, h->data, h->len, h);
+    bufUnref(h);
+    return 1;
+}
+
+/* Session id, 16 hex digits */
+static int
+parseSessionId(slice_t v, uint64_t *id) {
+    if (v.len != 16)
+        return -1;
+
+    *id = 0;
+    for (size_t i = 0; i < v.len; i++) {
+        char ch = v.p[i];
+        int d = ch >= '0' && ch <= '9' ? ch - '0' :
+            ch >= 'a' && ch <= 'f' ? ch - 'a' + 10 : -1;
+        if (d < 0)
+            return -1;
+        *id = (*id << 4) | d;
+    }
+    return 0;
+}
 
-#include <common/frontconf.h>
-#include "httpd.h"
-#include <common/game.h>
+/* Session of the request, from its cookie or a new one handed out with the
+    response. Every visitor shares one board when sessions are off */
+static session_t *
+connSession(conn_t *c) {
+    if (sessionMem == 0)
+        return &sharedSession;
+
+    slice_t v;
+    uint64_t id;
+    session_t *s;
+    if (httpCookie(&c->req, SESSION_COOKIE, &v) == 0 &&
+        parseSessionId(v, &id) == 0 && (s = sessionFind(id, now())) != NULL)
+            return s;
+
+    s = sessionNew(now());
+    sessionForgetEvicted();
+    if (s != NULL)
+        c->newSession = s->id;
+    return s;
+}
 
-#define BUFF_SIZE 65535
+/* Game a spectator asked to watch, by its public id, NULL if none is */
+static session_t *
+watchSession(slice_t v) {
+    uint64_t id;
+    if (parseSessionId(v, &id) < 0)
+        return NULL;
+    if (sessionMem == 0)
+        return &sharedSession;
+    return sessionFind(watchSessionId(id), now());
+}
 
-static const int* board = NULL;
-static int size = 0;
+/* Reactor owning the game the parsed request is for */
+static reactor_t *
+connOwner(conn_t *c) {
+    if (!isGamePath(c->req.path))
+        return self;
+    if (sessionMem == 0)
+        return &reactors[0];
+
+    slice_t v;
+    uint64_t id;
+    const slice_t *watch = httpParam(&c->req, "watch");
+    if (watch != NULL) {
+        if (parseSessionId(*watch, &id) == 0 &&
+            sessionShard(watchSessionId(id)) < nreactors)
+                return &reactors[sessionShard(watchSessionId(id))];
+        return self;
+    }
+    if (httpCookie(&c->req, SESSION_COOKIE, &v) == 0 &&
+        parseSessionId(v, &id) == 0 && sessionShard(id) < nreactors)
+            return &reactors[sessionShard(id)];
 
+    /* New session, here */
+    return self;
+}
 
-static const char* indexHeaders =
-"HTTP/1.1 200 OK\n"
-"Server: arfminesweeper httpd\n"
-"Content-Type: text/html\n";
+/* Pass the connection on to another reactor, which carries on from the
+    request already parsed. It must not be touched here after this */
+static void
+connHandoff(conn_t *c, reactor_t *to) {
+    idleUnlink(c);
+    #ifdef HTTPD_URING
+    if (!useUring)
+    #endif
+        evDel(c->fd);
+    if (write(to->handoff[1], &c, sizeof(c)) != sizeof(c)) {
+        printf("Error handing off connection\n");
+        connClose(c);
+    }
+}
 
-static const char* pngHeaders =
-"HTTP/1.1 200 OK\n"
-"Server: arfminesweeper httpd\n"
-"Content-Type: image/png\n";
+static int
+routeOf(slice_t path) {
+    for (int i = 0; i < ROUTE_STATIC; i++)
+        if (sliceEq(path, routeNames[i]))
+            return i;
+    return assetFind(path) != NULL ? ROUTE_STATIC : ROUTE_OTHER;
+}
 
-static const char* err404Headers =
-"HTTP/1.1 404 Not Found\n"
-"Server: arfminesweeper httpd\n";
+/* Count, time and log the request just answered, from when it was taken
+    up to its response being queued. Bad requests too, with as much of
+    their request line as was read */
+static void
+requestDone(conn_t *c, const char *status) {
+    const http_req_t *r = &c->req;
+    metrics_t *m = &self->metrics;
+    int route = routeOf(r->path);
+    uint64_t latency = nowUs() - c->start;
+    COUNTER_ADD(m->requests[route][status[0] - '1'], 1);
+    histRecord(&m->latency[route], latency);
+
+    access_rec_t rec;
+    accessRecord(&rec, c, status);
+    rec.latency = latency > UINT32_MAX ? UINT32_MAX : latency;
+    rec.targetLen = r->target.len > 255 ? 255 : r->target.len;
+    memcpy(rec.method, r->method.p,
+        r->method.len < sizeof(rec.method) ? r->method.len :
+            sizeof(rec.method));
+    memcpy(rec.target, r->target.p, rec.targetLen < ACCESS_LOG_TARGET ?
+        rec.targetLen : ACCESS_LOG_TARGET);
+    accessLog(&rec);
+}
 
-static const char* alertContent =
-"%s\n<!DOCTYPE html><html><head><script>alert(%s);</script></head>"
-"<body></body></html>";
+#define METRICS_HEAD_MAX 1024
 
-static char* htmlContent = NULL;
-static char* pngFlagContent = NULL;
-static size_t pngFlagSize = 0;
+/* /metrics, every reactor's counters summed, in Prometheus text format */
+static void
+respondMetrics(conn_t *c) {
+    uint64_t requests[NROUTES][5] = { { 0 } };
+    uint64_t moves = 0, conns = 0, pushClients = 0, sessions = 0, shed = 0;
+    for (int i = 0; i < nreactors; i++) {
+        const metrics_t *m = &reactors[i].metrics;
+        for (int j = 0; j < NROUTES; j++)
+            for (int k = 0; k < 5; k++)
+                requests[j][k] += COUNTER_GET(m->requests[j][k]);
+        moves += COUNTER_GET(m->moves);
+        conns += COUNTER_GET(m->conns);
+        pushClients += COUNTER_GET(m->pushClients);
+        sessions += COUNTER_GET(m->sessions);
+        shed += COUNTER_GET(m->shed);
+    }
 
-static char* sendBuffer = NULL;
+    size_t cap = METRICS_HEAD_MAX + NROUTES * (5 * 96 + HIST_TEXT_MAX);
+    buf_t *b = bufNew(cap);
+    if (b == NULL) {
+        respondOom(c);
+        return;
+    }
 
+    size_t n = snprintf(b->data, cap,
+        "# TYPE arfminesweeper_connections gauge\n"
+        "arfminesweeper_connections %lld\n"
+        "# TYPE arfminesweeper_connections_max gauge\n"
+        "arfminesweeper_connections_max %d\n"
+        "# TYPE arfminesweeper_connections_shed_total counter\n"
+        "arfminesweeper_connections_shed_total %llu\n"
+        "# TYPE arfminesweeper_push_clients gauge\n"
+        "arfminesweeper_push_clients %lld\n"
+        "# TYPE arfminesweeper_moves_total counter\n"
+        "arfminesweeper_moves_total %llu\n",
+        (long long)conns, maxConns, (unsigned long long)shed,
+        (long long)pushClients, (unsigned long long)moves);
+    if (sessionMem)
+        n += snprintf(b->data + n, cap - n,
+            "# TYPE arfminesweeper_sessions gauge\n"
+            "arfminesweeper_sessions %llu\n", (unsigned long long)sessions);
+
+    n += snprintf(b->data + n, cap - n,
+        "# TYPE arfminesweeper_http_requests_total counter\n");
+    for (int j = 0; j < NROUTES; j++)
+        for (int k = 0; k < 5; k++)
+            if (requests[j][k])
+                n += snprintf(b->data + n, cap - n,
+                    "arfminesweeper_http_requests_total"
+                    "{route=\"%s\",code=\"%dxx\"} %llu\n", routeNames[j],
+                    k + 1, (unsigned long long)requests[j][k]);
+
+    n += snprintf(b->data + n, cap - n,
+        "# TYPE arfminesweeper_http_request_duration_seconds histogram\n");
+    for (int j = 0; j < NROUTES; j++) {
+        /* Routes never requested, like the counts */
+        uint64_t total = 0;
+        for (int k = 0; k < 5; k++)
+            total += requests[j][k];
+        if (total == 0)
+            continue;
 
+        hist_t h = { 0 };
+        for (int i = 0; i < nreactors; i++)
+            histMerge(&h, &reactors[i].metrics.latency[j]);
 
-size_t strlcat(char* restrict dst, const char* restrict src, size_t dstsize) {
-    int d_len, s_len, offset, src_index;
+        char labels[32];
+        snprintf(labels, sizeof(labels), "route=\"%s\"", routeNames[j]);
+        n += histWrite(b->data + n, cap - n,
+            "arfminesweeper_http_request_duration_seconds", labels, &h);
+    }
 
-    /* obtain initial sizes */
-    d_len = strlen(dst);
-    s_len = strlen(src);
+    b->len = n;
+    respondBuf(c, "200 OK", "text/plain; version=0.0.4", b);
+    bufUnref(b);
+}
 
-    /* get the end of dst */
-    offset = d_len;
+/* Build the response to the parsed request in c->req */
+static void
+handleRequest(conn_t *c) {
+    const http_req_t *r = &c->req;
+    session_t *s;
+
+    /* HTTP/1.1 keeps alive unless told otherwise, HTTP/1.0 the opposite */
+    if (r->minor == 0)
+        c->closeAfter = !httpHeaderHasToken(r, "Connection", "keep-alive");
+    else
+        c->closeAfter = httpHeaderHasToken(r, "Connection", "close");
+
+    if (!sliceEq(r->method, "GET")) {
+        c->closeAfter = 1;
+        respond(c, "501 Not Implemented", "text/plain",
+            "Not Implemented\n", 16);
+        requestDone(c, "501 Not Implemented");
+        return;
+    }
 
-    /* append src */
-    src_index = 0;
-    while (*(src + src_index) != '\0')
-    {
-        *(dst + offset) = *(src + src_index);
-        offset++;
-        src_index++;
-        /* don't copy more than dstsize characters
-           minus one */
-        if (offset == dstsize - 1)
-            break;
+    const char *status = "200 OK";
+    const asset_t *a;
+    const slice_t *watch = httpParam(r, "watch");
+    if ((a = assetFind(r->path)) != NULL)
+        status = respondAsset(c, a);
+    else if (sliceEq(r->path, "/metrics"))
+        respondMetrics(c);
+    else if (!isGamePath(r->path)) {
+        status = "404 Not Found";
+        respond(c, status, "text/plain", "Not Found\n", 10);
+    }
+    else if (watch && sliceEq(r->path, "/api/move")) {
+        status = "403 Forbidden";
+        respond(c, status, "text/plain", "Spectators cannot move\n", 23);
+    }
+    else if (watch && (s = watchSession(*watch)) == NULL) {
+        status = "404 Not Found";
+        respond(c, status, "text/plain", "No such game\n", 13);
+    }
+    else if (!watch && (s = connSession(c)) == NULL) {
+        status = "503 Service Unavailable";
+        respond(c, status, "text/plain", "Too many players\n", 17);
+    }
+    else {
+        sessionUse(s);
+        /* Index, with an optional move unless only watching */
+        if (sliceEq(r->path, "/") && !watch)
+            applyMove(r);
+
+        if (isBoardView(r->path) && respondNotModified(c))
+            status = "304 Not Modified";
+        else if (sliceEq(r->path, "/"))
+            respondBoard(c);
+        else if (sliceEq(r->path, "/api/state"))
+            respondStateJson(c);
+        else if (sliceEq(r->path, "/api/state.bin"))
+            respondStateBin(c);
+        else if (sliceEq(r->path, "/api/move"))
+            respondMove(c);
+        else if (sliceEq(r->path, "/events"))
+            respondEvents(c);
+        else {
+            wsUpgrade(c);
+            status = c->ws ? "101 Switching Protocols" : "400 Bad Request";
+        }
     }
-    /* always cap the string! */
-    *(dst + offset) = '\0';
 
-    return d_len + s_len;
+    requestDone(c, status);
 }
 
-void
-cpynum(const char* restrict src, char* restrict dst, size_t dstsize) {
-    const char* restrict ptr = src;
-    while (*ptr && (*ptr >= 48 && *ptr <= 57) && (ptr - src < dstsize)) {
-        *dst = *ptr;
-        ptr++;
-        dst++;
+/* Gather queued segments into iov, producing the next stream chunk or the
+    board a lagging push client is owed once the queue is empty.
+    Returns how many, 0 once everything is sent */
+static int
+connGather(conn_t *c, struct iovec *iov) {
+    if (c->segHead == c->segTail) {
+        c->segHead = c->segTail = 0;
+        if (c->wsStale)
+            pushResync(c);
+        /* Only refill the chunk once nothing references it */
+        else if (!c->streaming || c->chunk->refs > 1)
+            return 0;
+        else
+            streamNext(c);
     }
-    *dst = '\0';
-}
 
-int
-strlencrlf(const char* str) {
-    const char* ptr = str;
-    int size = 0;
-    while (*ptr != '\0') {
-        if (*ptr == '\n') size++;
-        size++;
-        ptr++;
+    int n = 0;
+    for (int i = c->segHead; i < c->segTail && n < IOV_BATCH; i++, n++) {
+        iov[n].iov_base = (void*)c->segs[i].p;
+        iov[n].iov_len = c->segs[i].len;
     }
-    return size;
+    return n;
 }
 
+/* Drop the r bytes that went out, trim the segment it stopped in */
 static void
-convertcrlf(char* buff, size_t size) {
-    size_t bufflen = strlen(buff) + 1;
-    char* ptr = buff;
-
-    while (*ptr) {
-        char* p = strchr(ptr, '\n');
-        /* walked past last occurrence of needle or run out of buffer */
-        if (p == NULL || bufflen + 1 >= size || p >= buff + size) {
+connSent(conn_t *c, size_t r) {
+    c->outBytes -= r;
+    while (r > 0) {
+        seg_t *seg = &c->segs[c->segHead];
+        if (r < seg->len) {
+            seg->p += r;
+            seg->len -= r;
             break;
         }
+        r -= seg->len;
+        bufUnref(seg->buf);
+        c->segHead++;
+    }
+}
 
-        /* move part after lf */
-        memmove(p + 1, p, bufflen - (p - buff));
+/* Send as much as the socket takes, returns -1 to drop the connection */
+static int
+connWrite(conn_t *c) {
+    #ifdef HTTPD_URING
+    if (useUring)
+        return uringWrite(c);
+    #endif
+
+    struct iovec iov[IOV_BATCH];
+    int n;
+
+    while ((n = connGather(c, iov)) > 0) {
+        struct msghdr msg = { 0 };
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t r = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* Stop reading until the client catches up */
+                if (c->state != CONN_WRITING) {
+                    c->state = CONN_WRITING;
+                    evMod(c->fd, EV_OUT, c);
+                }
+                return 0;
+            }
+            return -1;
+        }
+        connSent(c, r);
+    }
 
-        /* insert cr */
-        *p = '\r';
+    if (c->closeAfter)
+        return -1;
 
-        bufflen++;
-        ptr = p + 2;
+    if (c->state != CONN_READING) {
+        c->state = CONN_READING;
+        evMod(c->fd, EV_IN, c);
     }
+    return 0;
 }
 
-static void
-convertlfescaped(char* buff, size_t size) {
-    size_t bufflen = strlen(buff) + 1;
-    char* ptr = buff;
+/* Answer every complete request buffered, then send. Requests behind a
+    stream wait for it to end, so responses stay in order, and so do ones
+    behind more output than OUT_QUEUE_MAX, until the client reads it.
+    Returns -1 to drop the connection, CONN_MOVED if it went to another
+    reactor */
+static int
+connProcess(conn_t *c) {
+    int handled, held;
+    c->start = nowUs();
+    do {
+        handled = held = 0;
+        while (!c->closeAfter && !c->streaming) {
+            if (c->sse) {
+                c->inLen = 0;
+                break;
+            }
+            if (c->ws) {
+                wsInput(c);
+                break;
+            }
+            if (c->outBytes >= OUT_QUEUE_MAX)
+                break;
+
+            int r = httpParse(&c->req, c->in, c->inLen);
+            if (r == HTTP_PARSE_PARTIAL) {
+                /* Full and not one complete request in it */
+                if (c->inLen == RECV_SIZE) {
+                    c->closeAfter = 1;
+                    respond(c, "431 Request Header Fields Too Large",
+                        "text/plain", "Request Too Large\n", 18);
+                    requestDone(c, "431 Request Header Fields Too Large");
+                }
+                break;
+            }
+            if (r == HTTP_PARSE_ERROR) {
+                c->closeAfter = 1;
+                respond(c, "400 Bad Request", "text/plain",
+                    "Bad Request\n", 12);
+                requestDone(c, "400 Bad Request");
+                break;
+            }
 
-    while (*ptr) {
-        char* p = strchr(ptr, '\n');
-        /* walked past last occurrence of needle or run out of buffer */
-        if (p == NULL || bufflen + 1 >= size || p >= buff + size) {
-            break;
+            /* Games are only ever touched by the reactor owning them. The
+                queue holds this thread's buffers, whose counts are not
+                atomic, so it goes once that is sent. The request stays
+                parsed until then */
+            reactor_t *owner = connOwner(c);
+            if (owner != self && c->segHead != c->segTail) {
+                held = 1;
+                break;
+            }
+            if (owner != self) {
+                connHandoff(c, owner);
+                return CONN_MOVED;
+            }
+
+            handleRequest(c);
+            handled++;
+
+            /* Pipelined bytes after it become the start of the next one */
+            size_t len = c->req.len;
+            memmove(c->in, c->in + len, c->inLen - len);
+            c->inLen -= len;
+            httpParseInit(&c->req);
+        }
+        if (connWrite(c) < 0)
+            return -1;
+        /* A stream that ended in that write releases the rest */
+    } while ((handled || held) && c->state == CONN_READING && !c->streaming);
+    return 0;
+}
+
+/* Read what is available, returns -1 to drop the connection */
+static int
+connRead(conn_t *c) {
+    while (c->inLen < RECV_SIZE) {
+        ssize_t r = recv(c->fd, c->in + c->inLen, RECV_SIZE - c->inLen, 0);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            printf("Error receiving \n");
+            return -1;
         }
+        else if (r == 0)
+            return -1;
+        c->inLen += r;
+    }
 
-        /* move part after lf */
-        memmove(p + 1, p, bufflen - (p - buff));
+    idleTouch(c);
+    return connProcess(c);
+}
 
-        /* insert cr */
-        p[0] = '\\';
-        p[1] = 'n';
+static void
+acceptClients(int lfd) {
+    while (1) {
+        struct sockaddr_in addr;
+        socklen_t addrLen = sizeof(addr);
+        int cfd = accept(lfd, (struct sockaddr*)&addr, &addrLen);
+        if (cfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                printf("Error accepting client\n");
+            return;
+        }
+        if (connAdmit(cfd) < 0)
+            continue;
 
-        bufflen += 2;
-        ptr = p + 2;
+        conn_t *c = calloc(1, sizeof(conn_t));
+        if (c == NULL || setNonBlocking(cfd) < 0 || evAdd(cfd, EV_IN, c) < 0) {
+            free(c);
+            close(cfd);
+            connRelease();
+            continue;
+        }
+        c->fd = cfd;
+        c->addr = addr.sin_addr.s_addr;
+        c->state = CONN_READING;
+        httpParseInit(&c->req);
+        idleTouch(c);
+        COUNTER_ADD(self->metrics.conns, 1);
     }
 }
 
+#ifdef HTTPD_URING
+/* io_uring backend: one ring per reactor, a multishot accept on its
+    listener, receives into buffers the kernel picks from a provided ring
+    and the last send of a connection linked to its close. Under load a
+    single io_uring_enter submits and reaps the work of every connection */
+#define URING_ENTRIES   1024
+#define URING_BUFS      1024    /* provided receive buffers, a power of 2 */
+#define URING_BUF_SIZE  4096
+#define URING_BGID      0
+
+/* What a completion is for, in the low bits of its conn_t pointer */
+#define URING_RECV      1
+#define URING_SEND      2
+#define URING_CLOSE     3
+#define URING_CANCEL    4
+#define URING_ACCEPT    5
+#define URING_HANDOFF   6
+#define URING_OP_MASK   7
+
+static _Thread_local struct io_uring ring;
+static _Thread_local struct io_uring_buf_ring *bufRing = NULL;
+static _Thread_local char *bufBase = NULL;
+/* Multishot requests that found no room in the queue, tried every loop */
+static _Thread_local int rearmAccept = 0, rearmHandoff = 0;
+
+static void adoptConnections(void);
+
+/* Room for n submissions, handing the queue over first if it is short.
+    Fails when the kernel takes none, e.g. while completions back up */
+static int
+uringReserve(unsigned n) {
+    if (io_uring_sq_space_left(&ring) < n)
+        io_uring_submit(&ring);
+    return io_uring_sq_space_left(&ring) < n ? -1 : 0;
+}
+
+/* Next submission for op on c, NULL if the queue has no room for it */
+static struct io_uring_sqe *
+uringSqe(conn_t *c, int op) {
+    if (uringReserve(1) < 0)
+        return NULL;
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    if (sqe == NULL)
+        return NULL;
+    io_uring_sqe_set_data(sqe, (void*)((uintptr_t)c | op));
+    if (c) c->pending++;
+    return sqe;
+}
+
+static void
+uringRecycle(int bid) {
+    io_uring_buf_ring_add(bufRing, bufBase + (size_t)bid * URING_BUF_SIZE,
+        URING_BUF_SIZE, bid, io_uring_buf_ring_mask(URING_BUFS), 0);
+    io_uring_buf_ring_advance(bufRing, 1);
+}
+
+/* Receive while it reads, the buffer is only taken once data arrives so
+    idle connections hold none. Closes c if it cannot, every caller is done
+    with c after this */
 static void
-printToSpace(const char* str) {
-    while (*str != ' ') {
-        putc(*str, stdout);
-        str++;
+uringRecv(conn_t *c) {
+    if (c->recving || c->closing || c->state != CONN_READING ||
+        c->inLen == RECV_SIZE)
+            return;
+
+    size_t room = RECV_SIZE - c->inLen;
+    struct io_uring_sqe *sqe = uringSqe(c, URING_RECV);
+    if (sqe == NULL) {
+        connClose(c);
+        return;
+    }
+    io_uring_prep_recv(sqe, c->fd, NULL,
+        room < URING_BUF_SIZE ? room : URING_BUF_SIZE, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    c->recving = 1;
+}
+
+/* One send in flight per connection, its completion sends the rest. The
+    last one of a connection closing after it carries the close linked */
+static int
+uringWrite(conn_t *c) {
+    if (c->sending || c->closing)
+        return 0;
+
+    int n = connGather(c, c->iov);
+    if (n == 0) {
+        if (c->closeAfter)
+            return -1;
+        c->state = CONN_READING;
+        return 0;
     }
+    c->state = CONN_WRITING;
+
+    int last = c->closeAfter && !c->streaming && c->segTail - c->segHead == n;
+    /* The send and its close go in together or not at all */
+    if (uringReserve(last ? 2 : 1) < 0)
+        return -1;
+
+    memset(&c->msg, 0, sizeof(c->msg));
+    c->msg.msg_iov = c->iov;
+    c->msg.msg_iovlen = n;
+    struct io_uring_sqe *sqe = uringSqe(c, URING_SEND);
+    if (sqe == NULL)
+        return -1;
+    /* A short send breaks the link, the close is then cancelled */
+    io_uring_prep_sendmsg(sqe, c->fd, &c->msg,
+        MSG_NOSIGNAL | (last ? MSG_WAITALL : 0));
+    c->sending = 1;
+
+    if (last) {
+        struct io_uring_sqe *cl = uringSqe(c, URING_CLOSE);
+        /* Not with the room reserved, else it is closed once sent */
+        if (cl == NULL)
+            return 0;
+        sqe->flags |= IOSQE_IO_LINK;
+        io_uring_prep_close(cl, c->fd);
+        c->linked = 1;
+    }
+    return 0;
 }
 
+/* Cancel what it has in flight and close it, it is freed once the last
+    completion is in */
 static void
-generateBoardResponse() {
-    char tmpBuff[BUFF_SIZE];
-    char tmpBuff2[1024];
-    tmpBuff[0] = '\0';
+uringClose(conn_t *c) {
+    if (!c->closing) {
+        c->closing = 1;
+        connDetach(c);
+    }
 
-    for (int y = 0; y < size; y++) {
-        strlcat(tmpBuff, "<tr>\n", BUFF_SIZE);
-        for (int x = 0; x < size; x++) {
-            int btni = (size * y) + x;
-            /* If clear, count surrounding cells and print n of mines */
-            if (CHECK_CLEAR(BOARDXY(x, y))) {
-                strlcat(tmpBuff, "<td>\n", BUFF_SIZE);
-                int n = gameGetSurroundingMines(x, y);
-                const char* color = NULL;
-                if (n) {
-                    switch (n) {
-                    case 1: color = "blue"; break;
-                    case 2: color = "green"; break;
-                    case 3: color = "red"; break;
-                    case 4: color = "darkblue"; break;
-                    case 5: color = "darkred"; break;
-                    case 6: color = "darkcyan"; break;
-                    case 7: color = "black"; break;
-                    case 8: color = "darkgrey"; break;
-                    }
-                    snprintf(tmpBuff2, 1024,
-                        "<span style=\"color: %s;\">%d</span>\n",
-                        color, n);
-                    strlcat(tmpBuff, tmpBuff2, BUFF_SIZE);
-                }
-                strlcat(tmpBuff2, "</td>\n", BUFF_SIZE);
-            }
-            /* If not clear, check flag and draw it */
-            else if (CHECK_FLAG(BOARDXY(x, y))) {
-                snprintf(tmpBuff2, 1024, "<td><button name=\"btn\" class=\"cell\">"
-                    "<img id=\"%d\" src=\"/flag.png\"></button></td>\n", btni);
-                strlcat(tmpBuff, tmpBuff2, BUFF_SIZE);
-            }
-            /* Otherwise just a tile */
-            else {
-                snprintf(tmpBuff2, 1024, "<td><a href=\"?clear=%d\" name=\"btn\">"
-                    "<button id=\"%d\" class=\"cell\"></button></a></td>\n",
-                    btni, btni);
-                strlcat(tmpBuff, tmpBuff2, BUFF_SIZE);
-            }
+    if (c->fd >= 0 && !c->linked) {
+        struct io_uring_sqe *sqe = NULL, *cl = NULL;
+        if (uringReserve(2) == 0) {
+            sqe = uringSqe(c, URING_CANCEL);
+            cl = uringSqe(c, URING_CLOSE);
+        }
+        if (sqe && cl) {
+            io_uring_prep_cancel_fd(sqe, c->fd, IORING_ASYNC_CANCEL_ALL);
+            /* Close even if there was nothing to cancel */
+            sqe->flags |= IOSQE_IO_HARDLINK;
+            io_uring_prep_close(cl, c->fd);
         }
-        strlcat(tmpBuff, "</tr>\n", BUFF_SIZE);
+        else {
+            /* No room, what it has in flight fails on the shut socket */
+            if (sqe) io_uring_prep_nop(sqe);
+            if (cl) io_uring_prep_nop(cl);
+            shutdown(c->fd, SHUT_RDWR);
+            close(c->fd);
+        }
+        c->fd = -1;
     }
 
-    /* Check game state*/
-    char alert[1024];
-    alert[0] = '\0';
-    switch (gameGetState()) {
-    case STATE_LOST: {
-        strncpy(alert, "alert(\""TXT_LOST"\");", 1024);
-        convertlfescaped(alert, 1024);
-    } break;
-    case STATE_WON: {
-        strncpy(alert, "alert(\""TXT_WON"\");", 1024);
-        convertlfescaped(alert, 1024);
-    } break;
-    }
+    if (c->pending == 0)
+        connFree(c);
+}
 
-    snprintf(sendBuffer, BUFF_SIZE, htmlContent, indexHeaders,
-        gameGetFlagsLeft(), tmpBuff, alert);
+/* Carry on once a send is done with, like EV_OUT does for epoll */
+static void
+uringResume(conn_t *c) {
+    int r = uringWrite(c);
+    /* Requests held back behind a finished stream */
+    if (r == 0 && c->state == CONN_READING && c->inLen)
+        r = connProcess(c);
+    if (r < 0)
+        connClose(c);
+    else if (r == 0)
+        uringRecv(c);
+}
 
-    convertcrlf(sendBuffer, BUFF_SIZE);
+static void
+uringAccept(void) {
+    struct io_uring_sqe *sqe = uringSqe(NULL, URING_ACCEPT);
+    rearmAccept = sqe == NULL;
+    if (sqe)
+        io_uring_prep_multishot_accept(sqe, self->lfd, NULL, NULL, 0);
 }
 
-static size_t
-generateFlagPNGResponse() {
-    snprintf(sendBuffer, BUFF_SIZE, "%s\n", pngHeaders);
-    size_t size = strlen(sendBuffer);
-    memcpy(sendBuffer + size, pngFlagContent, pngFlagSize);
-    return size + pngFlagSize;
+static void
+uringPollHandoff(void) {
+    struct io_uring_sqe *sqe = uringSqe(NULL, URING_HANDOFF);
+    rearmHandoff = sqe == NULL;
+    if (sqe)
+        io_uring_prep_poll_multishot(sqe, self->handoff[0], POLLIN);
 }
 
 static void
-generate404Response() {
-    snprintf(sendBuffer, BUFF_SIZE, "%s", err404Headers);
-    convertcrlf(sendBuffer, BUFF_SIZE);
+uringAccepted(int fd) {
+    if (connAdmit(fd) < 0)
+        return;
+    conn_t *c = calloc(1, sizeof(conn_t));
+    if (c == NULL) {
+        close(fd);
+        connRelease();
+        return;
+    }
+    /* Multishot accepts share no address buffer, ask for it */
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    if (getpeername(fd, (struct sockaddr*)&addr, &addrLen) == 0)
+        c->addr = addr.sin_addr.s_addr;
+
+    c->fd = fd;
+    c->state = CONN_READING;
+    httpParseInit(&c->req);
+    idleTouch(c);
+    uringRecv(c);
+    COUNTER_ADD(self->metrics.conns, 1);
 }
 
-static void*
-clientThread(void* data) {
-    int cfd = *(int*)data;
+static void
+uringReceived(conn_t *c, int res, unsigned flags) {
+    c->recving = 0;
+    if (flags & IORING_CQE_F_BUFFER) {
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0 && !c->closing) {
+            memcpy(c->in + c->inLen, bufBase + (size_t)bid * URING_BUF_SIZE,
+                res);
+            c->inLen += res;
+        }
+        uringRecycle(bid);
+    }
 
-    char recvBuff[BUFF_SIZE];
-    char tmpBuff[256];
+    if (c->closing) {
+        uringClose(c);
+        return;
+    }
+    if (res == -ENOBUFS) {
+        /* Every buffer was taken at once, they are back by the next submit */
+        uringRecv(c);
+        return;
+    }
+    if (res <= 0) {
+        if (res < 0) printf("Error receiving \n");
+        connClose(c);
+        return;
+    }
 
-    printf("Accepted connection\n");
+    idleTouch(c);
+    int r = connProcess(c);
+    if (r < 0)
+        connClose(c);
+    else if (r == 0)
+        uringRecv(c);
+}
 
-    /* Recv loop loop */
-    while (1) {
-        int r = recv(cfd, recvBuff, BUFF_SIZE, 0);
-        if (r < 0) {
-            printf("Error receiving \n");
-            return NULL;
+static void
+uringComplete(void *data, int res, unsigned flags) {
+    int op = (uintptr_t)data & URING_OP_MASK;
+    conn_t *c = (conn_t*)((uintptr_t)data & ~(uintptr_t)URING_OP_MASK);
+
+    switch (op) {
+    case URING_ACCEPT:
+        if (res >= 0)
+            uringAccepted(res);
+        else
+            printf("Error accepting client\n");
+        if (!(flags & IORING_CQE_F_MORE))
+            uringAccept();
+        return;
+    case URING_HANDOFF:
+        adoptConnections();
+        if (!(flags & IORING_CQE_F_MORE))
+            uringPollHandoff();
+        return;
+    }
+
+    c->pending--;
+    switch (op) {
+    case URING_RECV:
+        uringReceived(c, res, flags);
+        break;
+    case URING_SEND:
+        c->sending = 0;
+        if (c->closing) {
+            uringClose(c);
+            break;
         }
-        else if (r == 0) {
-            printf("Client exited \n");
-            return NULL;
+        if (res < 0) {
+            connClose(c);
+            break;
         }
+        connSent(c, res);
+        idleTouch(c);
+        /* The close behind it tells if that was all */
+        if (!c->linked)
+            uringResume(c);
+        break;
+    case URING_CLOSE:
+        if (c->linked) {
+            c->linked = 0;
+            if (res == -ECANCELED) {
+                /* The send fell short, send the rest and link again */
+                if (c->closing)
+                    uringClose(c);
+                else if (!c->sending)
+                    uringResume(c);
+                break;
+            }
+            c->fd = -1;
+        }
+        uringClose(c);
+        break;
+    case URING_CANCEL:
+        uringClose(c);
+        break;
+    }
+}
 
-        /*fwrite(recvBuff, 1, r, stdout);*/
+static int
+uringInit(void) {
+    struct io_uring_params p = { 0 };
+    /* Only this thread submits, completions wait for it to come for them */
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    if (io_uring_queue_init_params(URING_ENTRIES, &ring, &p) < 0) {
+        memset(&p, 0, sizeof(p));
+        if (io_uring_queue_init_params(URING_ENTRIES, &ring, &p) < 0)
+            return -1;
+    }
 
-        if (strncmp(recvBuff, "GET", 3) == 0) {
-            if (strncmp(recvBuff + 4, "/ ", 2) == 0) {
-                /* Index */
-                generateBoardResponse();
-                send(cfd, sendBuffer, strlen(sendBuffer), 0);
-                printf("GET / 200 OK\n");
-            }
-            else if (strncmp(recvBuff + 4, "/flag.png ", 10) == 0) {
-                /* Flag PNG file */
-                size_t size = generateFlagPNGResponse();
-                send(cfd, sendBuffer, size, 0);
-                printf("GET /flag.png 200 OK\n");
-            }
-            else if (strncmp(recvBuff + 4, "/?", 2) == 0) {
-                /* Parameter */
-                if (strncmp(recvBuff + 6, "clear=", 6) == 0) {
-                    cpynum(recvBuff + 12, tmpBuff, 256);
-                    int btni = atoi(tmpBuff);
-                    gameClearCell(btni % size, btni / size);
-                }
-                else if (strncmp(recvBuff + 6, "flag=", 5) == 0) {
-                    cpynum(recvBuff + 11, tmpBuff, 256);
-                    int btni = atoi(tmpBuff);
-                    gameFlagCell(btni % size, btni / size);
-                }
+    int err;
+    bufRing = io_uring_setup_buf_ring(&ring, URING_BUFS, URING_BGID, 0, &err);
+    bufBase = malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+    if (bufRing == NULL || bufBase == NULL) {
+        io_uring_queue_exit(&ring);
+        return -1;
+    }
+    for (int i = 0; i < URING_BUFS; i++)
+        io_uring_buf_ring_add(bufRing, bufBase + (size_t)i * URING_BUF_SIZE,
+            URING_BUF_SIZE, i, io_uring_buf_ring_mask(URING_BUFS), i);
+    io_uring_buf_ring_advance(bufRing, URING_BUFS);
 
-                generateBoardResponse();
-                send(cfd, sendBuffer, strlen(sendBuffer), 0);
-                printf("GET ");
-                printToSpace(recvBuff + 4);
-                printf(" 200 OK\n");
-            }
-            else {
-                /* 404 */
-                generate404Response();
-                send(cfd, sendBuffer, strlen(sendBuffer), 0);
-                printf("GET ");
-                printToSpace(recvBuff + 4);
-                printf(" 404 Not Found\n");
-            }
+    uringAccept();
+    uringPollHandoff();
+    return 0;
+}
+
+/* Event loop of one reactor on its ring */
+static void
+uringRun(void) {
+    while (1) {
+        if (rearmAccept) uringAccept();
+        if (rearmHandoff) uringPollHandoff();
+
+        struct __kernel_timespec ts = { .tv_sec = 1 };
+        struct io_uring_cqe *cqe;
+        int r = io_uring_submit_and_wait_timeout(&ring, &cqe, 1, &ts, NULL);
+        if (r < 0 && r != -ETIME && r != -EINTR) {
+            printf("Error waiting for completions: %s\n", strerror(-r));
+            return;
         }
-        else {
-            printf("Warning: Only GET supported\n");
-            return NULL;
+
+        while (io_uring_peek_cqe(&ring, &cqe) == 0) {
+            void *data = io_uring_cqe_get_data(cqe);
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            io_uring_cqe_seen(&ring, cqe);
+            uringComplete(data, res, flags);
         }
 
-        close(cfd);
-        printf("Connection closed\n");
-        return NULL;
+        closeIdle();
+        if (sessionMem) {
+            sessionExpire(now());
+            sessionForgetEvicted();
+            COUNTER_SET(self->metrics.sessions, sessionCount());
+        }
     }
 }
 
+/* Fall back to epoll where the kernel is too old for any of it */
+static int
+uringProbe(void) {
+    struct io_uring probe;
+    if (io_uring_queue_init(8, &probe, 0) < 0)
+        return -1;
+    int err;
+    struct io_uring_buf_ring *br = io_uring_setup_buf_ring(&probe, 1,
+        URING_BGID, 0, &err);
+    if (br)
+        io_uring_free_buf_ring(&probe, br, 1, URING_BGID);
+    io_uring_queue_exit(&probe);
+    return br ? 0 : -1;
+}
+#endif
+
+/* Whether port is free for this server alone. The listeners share it with
+    SO_REUSEPORT, which would let a second instance bind it too and take
+    part of the connections, so a plain bind is tried first */
+static int
+httpdPortFree(unsigned short port) {
+    struct sockaddr_in addr = { 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = 0;
+
+    int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0)
+        return 0;
+    int v = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void*)&v, sizeof(int));
+    int r = bind(fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_in));
+    close(fd);
+    return r == 0;
+}
+
 static int
 httpdListen(unsigned short port) {
     struct sockaddr_in addr = { 0 };
@@ -357,6 +2789,14 @@ httpdListen(unsigned short port) {
         return -1;
     }
 
+    /* One listener per reactor on the same port, the kernel spreads new
+        connections between them */
+    #ifdef SO_REUSEPORT
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void*)&v, sizeof(int)) < 0) {
+        return -1;
+    }
+    #endif
+
     /* Bind socket */
     if (bind(fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_in)) < 0) {
         printf("Error binding socket\n");
@@ -381,50 +2821,296 @@ loadFile(const char* path, char** buff, size_t* size) {
     fseek(f, 0L, SEEK_END);
     size_t s = ftell(f);
     fseek(f, 0L, SEEK_SET);
-    *buff = malloc(s);
+    *buff = malloc(s + 1);
     fread(*buff, 1, s, f);
+    (*buff)[s] = '\0';
+    fclose(f);
 
     if (size) *size = s;
 
     return 0;
 }
 
+/* Build both responses of an asset, with its content hash as etag */
+static int
+assetInit(asset_t *a) {
+    char *data;
+    size_t len;
+    if (loadFile(a->file, &data, &len) < 0)
+        return -1;
+
+    uint64_t h = 14695981039346656037ULL;   /* FNV-1a */
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)data[i]) * 1099511628211ULL;
+    snprintf(a->etag, sizeof(a->etag), "\"%016llx\"", (unsigned long long)h);
+
+    for (int close = 0; close < 2; close++) {
+        const char *conn = close ? "close" : "keep-alive";
+        buf_t *ok = bufNew(256 + len), *nm = bufNew(256);
+        if (ok == NULL || nm == NULL) {
+            free(data);
+            return -1;
+        }
+        ok->len = snprintf(ok->data, ok->cap, assetHeaders, a->type, len,
+            a->etag, conn);
+        bufAppend(ok, data, len);
+        nm->len = snprintf(nm->data, nm->cap, assetNotModifiedHeaders,
+            a->etag, conn);
+        a->ok[close] = ok;
+        a->notModified[close] = nm;
+    }
+
+    free(data);
+    return 0;
+}
+
+/* Connections handed over by other reactors, carry on with their request */
+static void
+adoptConnections(void) {
+    conn_t *c;
+    while (read(self->handoff[0], &c, sizeof(c)) == sizeof(c)) {
+        #ifdef HTTPD_URING
+        if (useUring) {
+            /* Nothing is in flight for it, it was between requests */
+            idleTouch(c);
+            int r = connProcess(c);
+            if (r < 0)
+                connClose(c);
+            else if (r == 0)
+                uringRecv(c);
+            continue;
+        }
+        #endif
+        if (evAdd(c->fd, c->state == CONN_WRITING ? EV_OUT : EV_IN, c) < 0) {
+            connClose(c);
+            continue;
+        }
+        idleTouch(c);
+        if (connProcess(c) < 0)
+            connClose(c);
+    }
+}
+
+/* Event loop of one reactor, the listener and handoff pipe are the entries
+    with no connection */
+static void *
+reactorRun(void *arg) {
+    self = arg;
+    if (accessLogThread() < 0)
+        printf("Warning: No access log for reactor %d\n", self->index);
+
+    /* Sessions are sharded by reactor, no locks between them */
+    if (sessionMem &&
+        sessionInit(sessionMem / nreactors, size, gameGetMines(),
+            self->index) < 0)
+                return NULL;
+
+    #ifdef HTTPD_URING
+    if (useUring) {
+        if (uringInit() < 0)
+            printf("Error starting reactor %d\n", self->index);
+        else
+            uringRun();
+        return NULL;
+    }
+    #endif
+
+    if (evInit() < 0 || evAdd(self->lfd, EV_IN, &listenerTag) < 0 ||
+        evAdd(self->handoff[0], EV_IN, &handoffTag) < 0)
+    {
+        printf("Error starting reactor %d\n", self->index);
+        return NULL;
+    }
+
+    ev_t evs[MAX_EVENTS];
+    while (1) {
+        int n = evWait(evs, MAX_EVENTS, 1000);
+        if (n < 0 && errno != EINTR) {
+            printf("Error waiting for events: %s\n", strerror(errno));
+            return NULL;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (evs[i].ptr == &listenerTag) {
+                acceptClients(self->lfd);
+                continue;
+            }
+            if (evs[i].ptr == &handoffTag) {
+                adoptConnections();
+                continue;
+            }
+
+            conn_t *c = evs[i].ptr;
+            int r = 0;
+            if (c->state == CONN_READING && evs[i].events & EV_IN)
+                r = connRead(c);
+            else if (c->state == CONN_WRITING && evs[i].events & EV_OUT) {
+                idleTouch(c);
+                r = connWrite(c);
+                /* Requests held back behind a finished stream */
+                if (r == 0 && c->state == CONN_READING && c->inLen)
+                    r = connProcess(c);
+            }
+
+            if (r < 0)
+                connClose(c);
+        }
+
+        closeIdle();
+        if (sessionMem) {
+            sessionExpire(now());
+            sessionForgetEvicted();
+            COUNTER_SET(self->metrics.sessions, sessionCount());
+        }
+    }
+
+    return NULL;
+}
+
+/* Give every visitor a game of their own, in at most bytes of memory */
+void
+httpdSetSessionMemory(size_t bytes) {
+    sessionMem = bytes;
+}
+
+/* Reactor threads to run, 0 for one per core */
+void
+httpdSetThreads(int n) {
+    nreactors = n;
+}
+
+/* Connections to serve at once, 0 for as many as descriptors allow */
+void
+httpdSetMaxConnections(int n) {
+    maxConns = n;
+}
+
+void
+httpdSetAccessLog(const char *path) {
+    accessLogPath = path;
+}
+
+/* Event backend, "epoll" (poll where there is none) or "uring" where
+    built with liburing, returns -1 for one not built */
+int
+httpdSetBackend(const char *name) {
+    if (!strcmp(name, "epoll")) {
+        #ifdef HTTPD_URING
+        useUring = 0;
+        #endif
+        return 0;
+    }
+    #ifdef HTTPD_URING
+    if (!strcmp(name, "uring")) {
+        useUring = 1;
+        return 0;
+    }
+    #endif
+    return -1;
+}
+
 int
 httpdStart(const int* lboard, int lsize) {
     board = lboard;
     size = lsize;
 
-    /* Load assets */
-    loadFile("../assets/msboard.html", &htmlContent, NULL);
-    loadFile("../assets/flag.png", &pngFlagContent, &pngFlagSize);
-
-    sendBuffer = malloc(65536);
+    /* Shared board, the one already initialised */
+    sharedSession.game = gameSelected();
+    sharedSession.refs = 1;
 
-    int lfd = httpdListen(8080);
-    if (lfd < 0)
+    /* Load assets */
+    if (loadFile("../assets/msboard.html", &htmlContent, NULL) < 0)
+        return -1;
+    for (size_t i = 0; i < NASSETS; i++)
+        if (assetInit(&assets[i]) < 0)
+            return -1;
+
+    renderInit();
+    bootId = (unsigned int)time(NULL);
+    if (accessLogOpen(accessLogPath) < 0) {
+        printf("Error opening access log %s\n", accessLogPath);
+        return -1;
+    }
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || read(fd, watchKey, sizeof(watchKey)) != sizeof(watchKey)) {
+        /* Guessable, but at least not the session ids themselves */
+        printf("Warning: No randomness for spectator ids\n");
+        for (int i = 0; i < 4; i++)
+            watchKey[i] = (uint32_t)rand() ^ bootId;
+    }
+    if (fd >= 0)
+        close(fd);
+
+    if (nreactors <= 0)
+        nreactors = sysconf(_SC_NPROCESSORS_ONLN);
+    #ifndef SO_REUSEPORT
+    nreactors = 1;
+    #endif
+    if (nreactors < 1) nreactors = 1;
+    if (nreactors > SESSION_MAX_SHARDS) nreactors = SESSION_MAX_SHARDS;
+
+    reactors = calloc(nreactors, sizeof(reactor_t));
+    if (reactors == NULL)
         return -1;
 
-    printf("Listening on 0.0.0.0:8080\n");
-
-    pthread_t cthread;
-    int cfd = -1;
-
-    /* Accept loop */
-    while (1) {
-        cfd = accept(lfd, NULL, NULL);
-        if (cfd < 0) {
-            printf("Error accepting client\n");
-            continue;
+    /* Shed before running out of descriptors, as many as allowed */
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0) {
+        if (nofile.rlim_cur < nofile.rlim_max) {
+            nofile.rlim_cur = nofile.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &nofile);
+            getrlimit(RLIMIT_NOFILE, &nofile);
+        }
+        rlim_t avail = nofile.rlim_cur > FD_RESERVE + 3 * (rlim_t)nreactors ?
+            nofile.rlim_cur - FD_RESERVE - 3 * (rlim_t)nreactors : 1;
+        if (avail > INT32_MAX) avail = INT32_MAX;
+        if (maxConns <= 0 || (rlim_t)maxConns > avail) {
+            if (maxConns > 0)
+                printf("Warning: Only descriptors for %d connections\n",
+                    (int)avail);
+            maxConns = avail;
         }
+    }
+    else if (maxConns <= 0)
+        maxConns = INT32_MAX;
 
-        pthread_create(&cthread, NULL, clientThread, &cfd);
-        pthread_detach(cthread);
+    if (!httpdPortFree(8080)) {
+        printf("Error binding socket: %s\n", strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < nreactors; i++) {
+        reactor_t *r = &reactors[i];
+        r->index = i;
+        r->lfd = httpdListen(8080);
+        if (r->lfd < 0 || setNonBlocking(r->lfd) < 0 ||
+            pipe(r->handoff) < 0 || setNonBlocking(r->handoff[0]) < 0)
+                return -1;
     }
 
-    return 0;
+    #ifdef HTTPD_URING
+    if (useUring && uringProbe() < 0) {
+        printf("Warning: io_uring not supported, using epoll\n");
+        useUring = 0;
+    }
+    #endif
+
+    printf("Listening on 0.0.0.0:8080 with %d reactors, up to %d "
+        "connections\n", nreactors, maxConns);
+
+    /* This thread is the first reactor, it owns the shared board */
+    for (int i = 1; i < nreactors; i++)
+        if (pthread_create(&reactors[i].thread, NULL, reactorRun,
+            &reactors[i]) != 0)
+        {
+            printf("Error creating reactor thread\n");
+            return -1;
+        }
+    reactorRun(&reactors[0]);
+
+    return -1;
 }
 
 void
 httpdDestroy() {
-
+    accessLogStop();
 }
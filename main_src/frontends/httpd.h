@@ -21,6 +21,13 @@
 #ifndef _HTTPD_H
 #define _HTTPD_H
 
+#include <stddef.h>
+
+void httpdSetSessionMemory(size_t bytes);
+void httpdSetThreads(int n);
+void httpdSetMaxConnections(int n);
+int httpdSetBackend(const char *name);
+void httpdSetAccessLog(const char *path);
 int httpdStart(const int *lboard, int lsize);
 void httpdDestroy();
 
@@ -0,0 +1,326 @@
+/*
+
+    arfminesweeper: Cross-plataform multi-frontend game
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    httpparse.c: Incremental zero-copy HTTP/1.x request parser, every field
+        is a slice into the caller's receive buffer, which must not move
+        while a request is being parsed
+
+*/
+
+#include <string.h>
+#include <strings.h>
+
+#include "httpparse.h"
+
+#define STATE_REQUEST_LINE  0
+#define STATE_HEADERS       1
+#define STATE_DONE          2
+
+void
+httpParseInit(http_req_t *r) {
+    r->state = STATE_REQUEST_LINE;
+    r->off = 0;
+    r->len = 0;
+    r->method.len = r->target.len = r->path.len = r->query.len = 0;
+    r->nheaders = 0;
+    r->nparams = 0;
+}
+
+static int
+isTokenChar(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+        (c >= '0' && c <= '9') || (c && strchr("!#$%&'*+-.^_`|~", c));
+}
+
+/* Split name=value&name=value, nameless or extra parameters are dropped */
+static void
+parseQuery(http_req_t *r) {
+    const char *p = r->query.p, *end = p + r->query.len;
+
+    while (p < end && r->nparams < HTTP_MAX_PARAMS) {
+        const char *amp = memchr(p, '&', end - p);
+        if (amp == NULL) amp = end;
+
+        const char *eq = memchr(p, '=', amp - p);
+        http_pair_t *pair = &r->params[r->nparams];
+        pair->name.p = p;
+        pair->name.len = (eq ? eq : amp) - p;
+        pair->value.p = eq ? eq + 1 : amp;
+        pair->value.len = eq ? amp - (eq + 1) : 0;
+        if (pair->name.len)
+            r->nparams++;
+
+        p = amp + 1;
+    }
+}
+
+/* METHOD SP origin-form SP HTTP/1.x */
+static int
+parseRequestLine(http_req_t *r, const char *line, size_t len) {
+    const char *end = line + len, *p = line;
+
+    while (p < end && *p >= 'A' && *p <= 'Z') p++;
+    if (p == line || p == end || *p != ' ')
+        return -1;
+    r->method.p = line;
+    r->method.len = p - line;
+
+    const char *target = ++p;
+    if (p == end || *p != '/')
+        return -1;
+    while (p < end && *p > ' ' && *p != 0x7f) p++;
+    if (p == end || *p != ' ')
+        return -1;
+    r->target.p = target;
+    r->target.len = p - target;
+
+    p++;
+    if (end - p != 8 || strncmp(p, "HTTP/1.", 7) != 0 ||
+        p[7] < '0' || p[7] > '9')
+            return -1;
+    r->minor = p[7] - '0';
+
+    const char *q = memchr(target, '?', r->target.len);
+    r->path.p = target;
+    r->path.len = (q ? q : target + r->target.len) - target;
+    r->query.p = q ? q + 1 : target + r->target.len;
+    r->query.len = q ? target + r->target.len - (q + 1) : 0;
+    parseQuery(r);
+
+    return 0;
+}
+
+/* name: value, optional whitespace trimmed */
+static int
+parseHeader(http_req_t *r, const char *line, size_t len) {
+    const char *end = line + len, *p = line;
+
+    while (p < end && isTokenChar(*p)) p++;
+    if (p == line || p == end || *p != ':')
+        return -1;
+    if (r->nheaders == HTTP_MAX_HEADERS)
+        return -1;
+
+    http_pair_t *pair = &r->headers[r->nheaders++];
+    pair->name.p = line;
+    pair->name.len = p - line;
+
+    p++;
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    pair->value.p = p;
+    pair->value.len = end - p;
+
+    return 0;
+}
+
+/* Feed the whole buffer received so far, only new bytes are scanned */
+int
+httpParse(http_req_t *r, const char *buff, size_t len) {
+    while (r->state != STATE_DONE) {
+        const char *line = buff + r->off;
+        const char *lf = memchr(line, '\n', len - r->off);
+        if (lf == NULL)
+            return HTTP_PARSE_PARTIAL;
+
+        size_t llen = lf - line;
+        if (llen && line[llen - 1] == '\r') llen--;
+        r->off = lf + 1 - buff;
+
+        if (r->state == STATE_REQUEST_LINE) {
+            /* Tolerate empty lines before a request */
+            if (llen == 0)
+                continue;
+            if (parseRequestLine(r, line, llen) < 0)
+                return HTTP_PARSE_ERROR;
+            r->state = STATE_HEADERS;
+        }
+        else if (llen == 0) {
+            r->state = STATE_DONE;
+        }
+        else if (parseHeader(r, line, llen) < 0) {
+            return HTTP_PARSE_ERROR;
+        }
+    }
+
+    r->len = r->off;
+    return HTTP_PARSE_DONE;
+}
+
+int
+sliceEq(slice_t s, const char *str) {
+    return strlen(str) == s.len && strncmp(s.p, str, s.len) == 0;
+}
+
+const slice_t *
+httpHeader(const http_req_t *r, const char *name) {
+    size_t nlen = strlen(name);
+    for (int i = 0; i < r->nheaders; i++)
+        if (r->headers[i].name.len == nlen &&
+            strncasecmp(r->headers[i].name.p, name, nlen) == 0)
+                return &r->headers[i].value;
+    return NULL;
+}
+
+/* Case insensitive token in a comma separated header value */
+int
+httpHeaderHasToken(const http_req_t *r, const char *name, const char *token) {
+    const slice_t *v = httpHeader(r, name);
+    if (v == NULL)
+        return 0;
+
+    size_t tlen = strlen(token);
+    const char *p = v->p, *end = v->p + v->len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        const char *t = p;
+        while (p < end && *p != ',') p++;
+        const char *te = p;
+        while (te > t && (te[-1] == ' ' || te[-1] == '\t')) te--;
+        if ((size_t)(te - t) == tlen && strncasecmp(t, token, tlen) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* Whether If-None-Match lists the quoted etag or is *, compared weakly
+    as RFC 7232 asks for it */
+int
+httpIfNoneMatch(const http_req_t *r, const char *etag) {
+    const slice_t *v = httpHeader(r, "If-None-Match");
+    if (v == NULL)
+        return 0;
+
+    size_t elen = strlen(etag);
+    const char *p = v->p, *end = v->p + v->len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        const char *t = p;
+        while (p < end && *p != ',') p++;
+        const char *te = p;
+        while (te > t && (te[-1] == ' ' || te[-1] == '\t')) te--;
+        if (te - t == 1 && *t == '*')
+            return 1;
+        if (te - t > 2 && t[0] == 'W' && t[1] == '/')
+            t += 2;
+        if ((size_t)(te - t) == elen && strncmp(t, etag, elen) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* Whether a ;-parameter list after a token has q=0 in it */
+static int
+isQZero(const char *p, const char *end) {
+    while (p < end) {
+        while (p < end && (*p == ';' || *p == ' ' || *p == '\t')) p++;
+        if (end - p >= 2 && (*p == 'q' || *p == 'Q') && p[1] == '=') {
+            p += 2;
+            if (p == end || *p != '0')
+                return 0;
+            while (++p < end && (*p == '.' || *p == '0'));
+            return p == end || *p == ';' || *p == ' ' || *p == '\t';
+        }
+        while (p < end && *p != ';') p++;
+    }
+    return 0;
+}
+
+/* Whether Accept-Encoding takes coding, by name or through *, and not
+    with q=0 */
+int
+httpAcceptsEncoding(const http_req_t *r, const char *coding) {
+    const slice_t *v = httpHeader(r, "Accept-Encoding");
+    if (v == NULL)
+        return 0;
+
+    size_t clen = strlen(coding);
+    int star = 0;
+    const char *p = v->p, *end = v->p + v->len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        const char *t = p;
+        while (p < end && *p != ',') p++;
+        const char *te = t;
+        while (te < p && *te != ';' && *te != ' ' && *te != '\t') te++;
+
+        if ((size_t)(te - t) == clen && strncasecmp(t, coding, clen) == 0)
+            return !isQZero(te, p);
+        if (te - t == 1 && *t == '*')
+            star = !isQZero(te, p);
+    }
+    return star;
+}
+
+const slice_t *
+httpParam(const http_req_t *r, const char *name) {
+    for (int i = 0; i < r->nparams; i++)
+        if (sliceEq(r->params[i].name, name))
+            return &r->params[i].value;
+    return NULL;
+}
+
+/* Value of a cookie sent in the Cookie header, 0 if present */
+int
+httpCookie(const http_req_t *r, const char *name, slice_t *v) {
+    const slice_t *h = httpHeader(r, "Cookie");
+    if (h == NULL)
+        return -1;
+
+    size_t nlen = strlen(name);
+    const char *p = h->p, *end = h->p + h->len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == ';')) p++;
+        const char *pair = p;
+        while (p < end && *p != ';') p++;
+
+        if ((size_t)(p - pair) > nlen && pair[nlen] == '=' &&
+            memcmp(pair, name, nlen) == 0)
+        {
+            v->p = pair + nlen + 1;
+            v->len = p - v->p;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Non-negative decimal, 0 if valid */
+int
+sliceInt(slice_t s, int *v) {
+    if (s.len == 0 || s.len > 9)
+        return -1;
+
+    int n = 0;
+    for (size_t i = 0; i < s.len; i++) {
+        if (s.p[i] < '0' || s.p[i] > '9')
+            return -1;
+        n = (n * 10) + (s.p[i] - '0');
+    }
+    *v = n;
+    return 0;
+}
+
+/* Non-negative decimal parameter, 0 if present and valid */
+int
+httpParamInt(const http_req_t *r, const char *name, int *v) {
+    const slice_t *s = httpParam(r, name);
+    if (s == NULL)
+        return -1;
+    return sliceInt(*s, v);
+}
@@ -0,0 +1,73 @@
+/*
+
+    arfminesweeper: Cross-plataform multi-frontend game
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef _HTTPPARSE_H
+#define _HTTPPARSE_H
+
+#include <stddef.h>
+
+#define HTTP_MAX_HEADERS    32
+#define HTTP_MAX_PARAMS     64  /* also the most moves in one batch */
+
+/* httpParse results */
+#define HTTP_PARSE_ERROR    -1
+#define HTTP_PARSE_PARTIAL  0
+#define HTTP_PARSE_DONE     1
+
+/* Bytes inside the receive buffer, not NUL terminated */
+typedef struct {
+    const char *p;
+    size_t len;
+} slice_t;
+
+typedef struct {
+    slice_t name, value;
+} http_pair_t;
+
+typedef struct {
+    /* Progress, so partial reads are not scanned again */
+    int state;
+    size_t off;
+    /* Valid once done, len is the whole request with its headers. The
+        request line's slices are set as soon as it is read, empty before */
+    size_t len;
+    slice_t method, target, path, query;
+    int minor;  /* HTTP/1.minor */
+    http_pair_t headers[HTTP_MAX_HEADERS];
+    int nheaders;
+    http_pair_t params[HTTP_MAX_PARAMS];
+    int nparams;
+} http_req_t;
+
+void httpParseInit(http_req_t *r);
+int httpParse(http_req_t *r, const char *buff, size_t len);
+
+int sliceEq(slice_t s, const char *str);
+int sliceInt(slice_t s, int *v);
+const slice_t *httpHeader(const http_req_t *r, const char *name);
+int httpHeaderHasToken(const http_req_t *r, const char *name,
+    const char *token);
+int httpIfNoneMatch(const http_req_t *r, const char *etag);
+int httpAcceptsEncoding(const http_req_t *r, const char *coding);
+const slice_t *httpParam(const http_req_t *r, const char *name);
+int httpParamInt(const http_req_t *r, const char *name, int *v);
+int httpCookie(const http_req_t *r, const char *name, slice_t *v);
+
+#endif /* _HTTPPARSE_H */
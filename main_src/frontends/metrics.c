@@ -0,0 +1,95 @@
+/*
+
+    arfminesweeper: Cross-plataform multi-frontend game
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    metrics.c: Lock free per thread counters and latency histograms for
+        httpd, summed and written in Prometheus text format on a scrape
+
+*/
+
+#include <stdio.h>
+
+#include "metrics.h"
+
+static int
+histIndex(uint64_t us) {
+    if (us < HIST_SUB)
+        return us;
+
+    /* Octave from the top bit, linear bucket from the bits below it */
+    int top = 63 - __builtin_clzll(us);
+    int octave = top - HIST_SUB_BITS + 1;
+    if (octave >= HIST_OCTAVES)
+        return HIST_BUCKETS - 1;
+    return octave * HIST_SUB + (int)(us >> (top - HIST_SUB_BITS)) - HIST_SUB;
+}
+
+/* Every value in bucket i is below this */
+static uint64_t
+histLimit(int i) {
+    if (i < HIST_SUB)
+        return i + 1;
+
+    int octave = i / HIST_SUB, sub = i % HIST_SUB;
+    uint64_t width = (uint64_t)1 << (octave - 1);
+    return ((uint64_t)HIST_SUB + sub + 1) * width;
+}
+
+/* From any thread, each bucket and the sum are added to atomically. The
+    two adds are not one, a merge may see a record's bucket but not yet
+    its latency in the sum */
+void
+histRecord(hist_t *h, uint64_t us) {
+    COUNTER_ADD(h->buckets[histIndex(us)], 1);
+    COUNTER_ADD(h->sum, us);
+}
+
+/* Add from, recorded into by any thread, to to, owned by the caller */
+void
+histMerge(hist_t *to, const hist_t *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        to->buckets[i] += COUNTER_GET(from->buckets[i]);
+    to->sum += COUNTER_GET(from->sum);
+}
+
+/* Prometheus histogram in seconds, labels inside the braces or "". Buckets
+    are cumulative and the count is their total, so they always agree.
+    Returns the length, at most HIST_TEXT_MAX */
+size_t
+histWrite(char *o, size_t len, const char *name, const char *labels,
+    const hist_t *h)
+{
+    const char *sep = labels[0] ? "," : "";
+    size_t n = 0;
+    uint64_t total = 0;
+
+    for (int i = 0; i < HIST_BUCKETS && n < len; i++) {
+        total += h->buckets[i];
+        if (i == HIST_BUCKETS - 1)
+            n += snprintf(o + n, len - n, "%s_bucket{%s%sle=\"+Inf\"} %llu\n",
+                name, labels, sep, (unsigned long long)total);
+        else
+            n += snprintf(o + n, len - n, "%s_bucket{%s%sle=\"%.9g\"} %llu\n",
+                name, labels, sep, histLimit(i) / 1e6,
+                (unsigned long long)total);
+    }
+    if (n < len)
+        n += snprintf(o + n, len - n, "%s_sum{%s} %.6f\n%s_count{%s} %llu\n",
+            name, labels, h->sum / 1e6, name, labels,
+            (unsigned long long)total);
+    return n < len ? n : len;
+}
@@ -0,0 +1,59 @@
+/*
+
+    arfminesweeper: Cross-plataform multi-frontend game
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+*/
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Counters are meant to be written by the thread they belong to and read
+    from any, but adding is atomic all the same so a stray writer does not
+    lose counts. Relaxed, nothing is ordered by them. COUNTER_SET is only
+    for gauges one thread owns */
+#define COUNTER_ADD(c, n)   __atomic_fetch_add(&(c), (n), __ATOMIC_RELAXED)
+#define COUNTER_SET(c, v)   __atomic_store_n(&(c), (v), __ATOMIC_RELAXED)
+#define COUNTER_GET(c)      __atomic_load_n(&(c), __ATOMIC_RELAXED)
+
+/* Latency histogram in microseconds, HDR style: every power of 2 is split
+    in HIST_SUB linear buckets, so a bucket is within 1 / HIST_SUB of its
+    values at any scale. Up to 2^(HIST_OCTAVES + HIST_SUB_BITS - 1) us,
+    about 33 s, and one more bucket past that */
+#define HIST_SUB_BITS   2
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_OCTAVES    24
+#define HIST_BUCKETS    (HIST_OCTAVES * HIST_SUB + 1)
+
+/* Most histWrite writes */
+#define HIST_LINE_MAX   160
+#define HIST_TEXT_MAX   ((HIST_BUCKETS + 2) * HIST_LINE_MAX)
+
+typedef struct {
+    uint64_t sum;
+    uint64_t buckets[HIST_BUCKETS];
+} hist_t;
+
+void histRecord(hist_t *h, uint64_t us);
+void histMerge(hist_t *to, const hist_t *from);
+size_t histWrite(char *o, size_t len, const char *name, const char *labels,
+    const hist_t *h);
+
+#endif /* _METRICS_H */
@@ -0,0 +1,257 @@
+/*
+
+    arfminesweeper: Cross-plataform multi-frontend game
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    session.c: Per-player games for httpd, in an open addressing table
+        sized once from a memory cap. Unused sessions are evicted least
+        recently used first, when idle too long or to make room. Every
+        thread has a table of its own, a shard, and only ever touches it
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "session.h"
+
+/* Linear probing on the low bits of the id, which are random */
+static _Thread_local session_t **slots = NULL;
+static _Thread_local size_t mask = 0;
+static _Thread_local size_t count = 0, maxSessions = 0;
+
+static _Thread_local session_t *lruHead = NULL, *lruTail = NULL;
+
+static _Thread_local int boardSize = 0, boardMines = 0;
+/* Top bits of every id handed out, see sessionShard */
+static _Thread_local uint64_t shardBits = 0;
+
+/* Unguessable ids, a session id is all it takes to play someone's game */
+static _Thread_local int randomFd = -1;
+static _Thread_local uint64_t randomBuff[64];
+static _Thread_local int randomLeft = 0;
+
+static uint64_t
+randomId(void) {
+    if (randomLeft == 0) {
+        if (randomFd < 0 ||
+            read(randomFd, randomBuff, sizeof(randomBuff)) !=
+                sizeof(randomBuff))
+        {
+            /* Not secret, but still unique */
+            for (int i = 0; i < 64; i++)
+                randomBuff[i] = (uint64_t)rand() << 32 ^ rand();
+        }
+        randomLeft = 64;
+    }
+    return randomBuff[--randomLeft];
+}
+
+static void
+lruUnlink(session_t *s) {
+    if (s->prev) s->prev->next = s->next; else lruHead = s->next;
+    if (s->next) s->next->prev = s->prev; else lruTail = s->prev;
+    s->prev = s->next = NULL;
+}
+
+static void
+lruAppend(session_t *s) {
+    s->prev = lruTail;
+    s->next = NULL;
+    if (lruTail) lruTail->next = s; else lruHead = s;
+    lruTail = s;
+}
+
+static size_t
+slotOf(uint64_t id) {
+    size_t i = id & mask;
+    while (slots[i] && slots[i]->id != id)
+        i = (i + 1) & mask;
+    return i;
+}
+
+/* Backward shift deletion, no tombstones to slow lookups down */
+static void
+tableRemove(session_t *s) {
+    size_t i = slotOf(s->id), j = i;
+    slots[i] = NULL;
+
+    while (slots[j = (j + 1) & mask]) {
+        size_t k = slots[j]->id & mask;
+        /* Move it back unless its home lies cyclically in (i, j] */
+        if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+            slots[i] = slots[j];
+            slots[j] = NULL;
+            i = j;
+        }
+    }
+    count--;
+}
+
+static void
+evict(session_t *s) {
+    game_t *selected = gameSelected();
+
+    tableRemove(s);
+    lruUnlink(s);
+    gameSelect(s->game);
+    gameDestroy();
+    gameSelect(selected == s->game ? NULL : selected);
+    free(s);
+}
+
+/* Shard a session id was handed out by */
+int
+sessionShard(uint64_t id) {
+    return id >> SESSION_SHARD_SHIFT;
+}
+
+/* This thread's shard, with room for as many sessions as memCap bytes fit,
+    boards and all */
+int
+sessionInit(size_t memCap, int size, int mines, int shard) {
+    size_t each = sizeof(session_t) + sizeof(game_t) +
+        gameMemorySize(size) + ARENA_ALIGN + sizeof(session_t*) * 2;
+
+    boardSize = size;
+    boardMines = mines;
+    shardBits = (uint64_t)shard << SESSION_SHARD_SHIFT;
+    maxSessions = memCap / each;
+    if (maxSessions == 0) {
+        printf("Error: Session memory too small for one %dx%d board\n",
+            size, size);
+        return -1;
+    }
+
+    /* At most half full */
+    size_t cap = 2;
+    while (cap < maxSessions * 2) cap <<= 1;
+    slots = calloc(cap, sizeof(session_t*));
+    if (slots == NULL) {
+        printf("Error: Allocating session table\n");
+        return -1;
+    }
+    mask = cap - 1;
+
+    randomFd = open("/dev/urandom", O_RDONLY);
+    if (randomFd < 0)
+        printf("Warning: No /dev/urandom, session ids are guessable\n");
+
+    printf("Up to %zu sessions in shard %d\n", maxSessions, shard);
+    return 0;
+}
+
+/* Session with this id, marked used */
+session_t *
+sessionFind(uint64_t id, time_t now) {
+    session_t *s = slots[slotOf(id)];
+    if (s == NULL)
+        return NULL;
+
+    s->lastActive = now;
+    if (s->refs == 0) {
+        lruUnlink(s);
+        lruAppend(s);
+    }
+    return s;
+}
+
+/* New session with a fresh game, evicting the least recently used unheld
+    sessions to stay under the cap. NULL if every one is held */
+session_t *
+sessionNew(time_t now) {
+    while (count >= maxSessions) {
+        if (lruHead == NULL)
+            return NULL;
+        evict(lruHead);
+    }
+
+    session_t *s = calloc(1, sizeof(session_t) + sizeof(game_t));
+    if (s == NULL)
+        return NULL;
+    s->game = (game_t*)(s + 1);
+
+    game_t *selected = gameSelected();
+    gameSelect(s->game);
+    int r = gameInit(boardSize, boardMines);
+    if (r < 0) gameDestroy();
+    gameSelect(selected);
+    if (r < 0) {
+        free(s);
+        return NULL;
+    }
+
+    do {
+        s->id = (randomId() >> SESSION_SHARD_BITS) | shardBits;
+    } while (s->id == 0 || slots[slotOf(s->id)]);
+    slots[slotOf(s->id)] = s;
+    count++;
+
+    s->lastActive = now;
+    lruAppend(s);
+    return s;
+}
+
+void
+sessionRef(session_t *s) {
+    if (s->refs++ == 0)
+        lruUnlink(s);
+}
+
+void
+sessionUnref(session_t *s, time_t now) {
+    if (--s->refs == 0) {
+        s->lastActive = now;
+        lruAppend(s);
+    }
+}
+
+/* Drop unheld sessions unused for SESSION_TIMEOUT */
+void
+sessionExpire(time_t now) {
+    while (lruHead && lruHead->lastActive < now - SESSION_TIMEOUT)
+        evict(lruHead);
+}
+
+size_t
+sessionCount(void) {
+    return count;
+}
+
+/* Every session, held or not */
+void
+sessionDestroy(void) {
+    game_t *selected = gameSelected();
+    for (size_t i = 0; slots && i <= mask; i++) {
+        if (slots[i] == NULL)
+            continue;
+        if (selected == slots[i]->game)
+            selected = NULL;
+        gameSelect(slots[i]->game);
+        gameDestroy();
+        free(slots[i]);
+    }
+    gameSelect(selected);
+    free(slots);
+    slots = NULL;
+    count = 0;
+    lruHead = lruTail = NULL;
+    if (randomFd >= 0)
+        close(randomFd);
+    randomFd = -1;
+}
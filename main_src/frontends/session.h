@@ -0,0 +1,60 @@
+/*
+
+    arfminesweeper: Cross-plataform multi-frontend game
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    session.h: Per-player game sessions for httpd, sharded by thread
+
+*/
+
+#ifndef _SESSION_H
+#define _SESSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <common/game.h>
+
+#define SESSION_TIMEOUT     1800    /* seconds unused before it is dropped */
+
+/* Ids carry the shard that owns them in their top bits */
+#define SESSION_SHARD_BITS  8
+#define SESSION_SHARD_SHIFT (64 - SESSION_SHARD_BITS)
+#define SESSION_MAX_SHARDS  (1 << SESSION_SHARD_BITS)
+
+struct conn_s;
+
+typedef struct session_s {
+    uint64_t id;
+    game_t *game;
+    time_t lastActive;
+    int refs;                       /* held, never evicted while > 0 */
+    struct session_s *prev, *next;  /* unheld ones, least recent first */
+    struct conn_s *clients;         /* websocket clients, kept by httpd */
+} session_t;
+
+int sessionShard(uint64_t id);
+int sessionInit(size_t memCap, int size, int mines, int shard);
+session_t *sessionFind(uint64_t id, time_t now);
+session_t *sessionNew(time_t now);
+void sessionRef(session_t *s);
+void sessionUnref(session_t *s, time_t now);
+void sessionExpire(time_t now);
+size_t sessionCount(void);
+void sessionDestroy(void);
+
+#endif /* _SESSION_H */
@@ -0,0 +1,193 @@
+/*
+
+    arfminesweeper: Cross-plataform multi-frontend game
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    websocket.c: RFC 6455 handshake and framing, the transport is up to the
+        caller
+
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "websocket.h"
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+/* SHA-1, only for the handshake */
+typedef struct {
+    uint32_t h[5];
+    uint64_t len;
+    unsigned char block[64];
+    size_t n;
+} sha1_t;
+
+#define ROL(x, n)   (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void
+sha1Block(sha1_t *s, const unsigned char *p) {
+    uint32_t w[80], a, b, c, d, e, f, k, t;
+
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 |
+            (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    for (int i = 16; i < 80; i++)
+        w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3]; e = s->h[4];
+    for (int i = 0; i < 80; i++) {
+        if (i < 20) { f = (b & c) | (~b & d); k = 0x5a827999; }
+        else if (i < 40) { f = b ^ c ^ d; k = 0x6ed9eba1; }
+        else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8f1bbcdc; }
+        else { f = b ^ c ^ d; k = 0xca62c1d6; }
+        t = ROL(a, 5) + f + e + k + w[i];
+        e = d; d = c; c = ROL(b, 30); b = a; a = t;
+    }
+    s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d; s->h[4] += e;
+}
+
+static void
+sha1Update(sha1_t *s, const void *data, size_t len) {
+    const unsigned char *p = data;
+    s->len += len;
+    while (len--) {
+        s->block[s->n++] = *p++;
+        if (s->n == 64) {
+            sha1Block(s, s->block);
+            s->n = 0;
+        }
+    }
+}
+
+static void
+sha1Final(sha1_t *s, unsigned char *out) {
+    uint64_t bits = s->len * 8;
+    unsigned char pad = 0x80;
+    sha1Update(s, &pad, 1);
+    pad = 0;
+    while (s->n != 56)
+        sha1Update(s, &pad, 1);
+    for (int i = 7; i >= 0; i--) {
+        unsigned char b = bits >> (i * 8);
+        sha1Update(s, &b, 1);
+    }
+    for (int i = 0; i < 20; i++)
+        out[i] = s->h[i / 4] >> (24 - (i % 4) * 8);
+}
+
+/* Standard base64 with padding, returns the BASE64_LEN(len) bytes written.
+    Not terminated */
+size_t
+base64Encode(char *o, const void *data, size_t len) {
+    static const char b64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const unsigned char *p = data;
+    char *start = o;
+
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t v = (uint32_t)p[i] << 16 |
+            (i + 1 < len ? (uint32_t)p[i + 1] << 8 : 0) |
+            (i + 2 < len ? p[i + 2] : 0);
+        *o++ = b64[(v >> 18) & 63];
+        *o++ = b64[(v >> 12) & 63];
+        *o++ = i + 1 < len ? b64[(v >> 6) & 63] : '=';
+        *o++ = i + 2 < len ? b64[v & 63] : '=';
+    }
+    return o - start;
+}
+
+/* Sec-WebSocket-Accept for a Sec-WebSocket-Key, out holds
+    WS_ACCEPT_LEN + 1 */
+void
+wsAccept(const char *key, size_t len, char *out) {
+    sha1_t s = { { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+        0xc3d2e1f0 }, 0, { 0 }, 0 };
+    unsigned char d[20];
+
+    sha1Update(&s, key, len);
+    sha1Update(&s, WS_GUID, sizeof(WS_GUID) - 1);
+    sha1Final(&s, d);
+    out[base64Encode(out, d, sizeof(d))] = '\0';
+}
+
+/* One client frame at the start of buff. Client frames must be masked,
+    the payload is unmasked in place */
+int
+wsParse(char *buff, size_t len, ws_frame_t *f) {
+    unsigned char *p = (unsigned char*)buff;
+    if (len < 2)
+        return WS_PARSE_PARTIAL;
+
+    f->fin = p[0] >> 7;
+    f->op = p[0] & 0x0f;
+    if ((p[0] & 0x70) || !(p[1] & 0x80))
+        return WS_PARSE_ERROR;
+
+    size_t hdr = 2;
+    uint64_t plen = p[1] & 0x7f;
+    if (plen == 126) {
+        hdr += 2;
+        if (len < hdr) return WS_PARSE_PARTIAL;
+        plen = (uint64_t)p[2] << 8 | p[3];
+    }
+    else if (plen == 127) {
+        hdr += 8;
+        if (len < hdr) return WS_PARSE_PARTIAL;
+        plen = 0;
+        for (int i = 2; i < 10; i++)
+            plen = (plen << 8) | p[i];
+    }
+
+    /* Control frames are short and never fragmented */
+    if (f->op & 0x8 && (plen > 125 || !f->fin))
+        return WS_PARSE_ERROR;
+
+    const unsigned char *mask = p + hdr;
+    hdr += 4;
+    if (len < hdr || len - hdr < plen)
+        return WS_PARSE_PARTIAL;
+
+    f->payload = buff + hdr;
+    f->len = plen;
+    f->size = hdr + plen;
+    for (size_t i = 0; i < plen; i++)
+        f->payload[i] ^= mask[i & 3];
+    return WS_PARSE_DONE;
+}
+
+/* Write an unmasked, final frame header, at most WS_HDR_MAX bytes,
+    returns its length */
+size_t
+wsHeader(char *o, int op, size_t len) {
+    unsigned char *p = (unsigned char*)o;
+
+    p[0] = 0x80 | op;
+    if (len < 126) {
+        p[1] = len;
+        return 2;
+    }
+    if (len <= 0xffff) {
+        p[1] = 126;
+        p[2] = len >> 8;
+        p[3] = len;
+        return 4;
+    }
+    p[1] = 127;
+    for (int i = 9; i >= 2; i--, len >>= 8)
+        p[i] = len;
+    return 10;
+}
@@ -0,0 +1,58 @@
+/*
+
+    arfminesweeper: Cross-plataform multi-frontend game
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    websocket.h: RFC 6455 handshake and framing helpers
+
+*/
+
+#ifndef _WEBSOCKET_H
+#define _WEBSOCKET_H
+
+#include <stddef.h>
+
+/* Frame opcodes */
+#define WS_OP_CONT      0x0
+#define WS_OP_TEXT      0x1
+#define WS_OP_BINARY    0x2
+#define WS_OP_CLOSE     0x8
+#define WS_OP_PING      0x9
+#define WS_OP_PONG      0xa
+
+/* wsParse results */
+#define WS_PARSE_ERROR      -1
+#define WS_PARSE_PARTIAL    0
+#define WS_PARSE_DONE       1
+
+#define WS_HDR_MAX      10  /* longest server frame header */
+#define WS_ACCEPT_LEN   28  /* base64 of a SHA-1 */
+
+#define BASE64_LEN(n)   (((n) + 2) / 3 * 4)
+
+typedef struct {
+    int fin, op;
+    char *payload;  /* unmasked in place, inside the caller's buffer */
+    size_t len;
+    size_t size;    /* whole frame, header included */
+} ws_frame_t;
+
+size_t base64Encode(char *o, const void *data, size_t len);
+void wsAccept(const char *key, size_t len, char *out);
+int wsParse(char *buff, size_t len, ws_frame_t *f);
+size_t wsHeader(char *o, int op, size_t len);
+
+#endif /* _WEBSOCKET_H */
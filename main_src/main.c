@@ -26,6 +26,10 @@
 
 #include <common/game.h>
 
+#ifndef _WIN32
+#include "shmexport.h"
+#endif
+
 #include "frontends/console.h"
 #include "frontends/fbdev.h"
 #include "frontends/xlib.h"
@@ -49,6 +53,7 @@
 #include "frontends/vt100.h"
 #include "frontends/ansi.h"
 #include "frontends/java.h"
+#include "frontends/botsock.h"
 
 #include <common/frontconf.h>
 
@@ -59,11 +64,22 @@
 void
 printUsage(const char *self) {
     printf("Usage: %s [--frontend|-f API] [--size|-s size]\n"
-        "\t[--mines|-m N of mines] [--help]\n\n"
+        "\t[--mines|-m N of mines] [--safe|-S 0|1] [--shm|-x name]\n"
+        "\t[--sessions|-M MiB] [--threads|-T N] [--io|-I epoll|uring]\n"
+        "\t[--log|-L file] [--max-conns|-C N] [--help]\n\n"
         "\t--help | -h:     Get this message\n"
         "\t--frontend | -f: Frontend to use, see compiled\n"
         "\t--size | -s:     Board size (square side length)\n"
-        "\t--mines | -m:    Number of random mines to place\n", self);
+        "\t--mines | -m:    Number of random mines to place\n"
+        "\t--safe | -S:     Never lose on the first click\n"
+        "\t--shm | -x:      Export the board in a POSIX shared memory segment\n"
+        "\t--sessions | -M: webapp: a board per player, in at most MiB\n"
+        "\t--threads | -T:  webapp: event loop threads, default one per core\n"
+        "\t--io | -I:       webapp: I/O backend, default epoll\n"
+        "\t--log | -L:      webapp: access log file, default stdout\n"
+        "\t--max-conns | -C: webapp: connections served at once, more get a\n"
+        "\t                 503, default as many as file descriptors allow\n",
+        self);
 }
 
 void
@@ -138,6 +154,9 @@ printFrontends() {
     #ifdef FRONTEND_JAVA
         printf("java ");
     #endif
+    #ifdef FRONTEND_BOTSOCK
+        printf("bot ");
+    #endif
 
     printf("\n");
 }
@@ -151,14 +170,15 @@ main(int argc, char **argv) {
 
     printFrontends();
 
-    const char *frontend = NULL;
-    int size = 0, mines = 0;
+    const char *frontend = NULL, *shm = NULL, *io = NULL, *logPath = NULL;
+    int size = 0, mines = 0, safe = 0, sessions = 0, threads = 0;
+    int maxConns = 0;
 
     /* Parse command-line options */
     if (argc == 1) {
         /* Default */
     }
-    else if (argc == 2 || argc == 4 || argc == 6) {
+    else if (argc % 2 == 0) {
         /* Unpossible */
         printUsage(argv[0]);
         exit(1);
@@ -171,16 +191,49 @@ main(int argc, char **argv) {
                 size = atoi(argv[i + 1]);
             if (!strcmp(argv[i], "--mines") || !strcmp(argv[i], "-m"))
                 mines = atoi(argv[i + 1]);
+            if (!strcmp(argv[i], "--safe") || !strcmp(argv[i], "-S"))
+                safe = atoi(argv[i + 1]);
+            if (!strcmp(argv[i], "--shm") || !strcmp(argv[i], "-x"))
+                shm = argv[i + 1];
+            if (!strcmp(argv[i], "--sessions") || !strcmp(argv[i], "-M"))
+                sessions = atoi(argv[i + 1]);
+            if (!strcmp(argv[i], "--threads") || !strcmp(argv[i], "-T"))
+                threads = atoi(argv[i + 1]);
+            if (!strcmp(argv[i], "--io") || !strcmp(argv[i], "-I"))
+                io = argv[i + 1];
+            if (!strcmp(argv[i], "--log") || !strcmp(argv[i], "-L"))
+                logPath = argv[i + 1];
+            if (!strcmp(argv[i], "--max-conns") || !strcmp(argv[i], "-C"))
+                maxConns = atoi(argv[i + 1]);
         }
     }
 
     if (frontend == NULL) frontend = "console";
     if (size == 0) size = 8;
     if (mines == 0) mines = 10;
+    if (size < 1 || size > GAME_MAX_SIZE) {
+        printf("Error: Size must be between 1 and %d\n", GAME_MAX_SIZE);
+        exit(1);
+    }
 
     printf("Starting game with %s frontend, %dx%d in size with %d mines\n",
         frontend, size, size, mines);
-    gameInit(size, mines);
+    if (shm) {
+        #ifndef _WIN32
+        void *mem = shmExportCreate(shm, gameMemorySize(size));
+        if (mem == NULL) exit(1);
+        gameSetMemory(mem, gameMemorySize(size));
+        #else
+        printf("Error: Shared memory export not supported\n");
+        #endif
+    }
+
+    gameSetSafeFirstClick(safe);
+    if (gameInit(size, mines) < 0) {
+        printf("Error: Cannot start a %dx%d game with %d mines\n", size,
+            size, mines);
+        exit(1);
+    }
 
     if (!strcmp(frontend, "console")) {
         conStart(gameGetBoard(), size);
@@ -283,6 +336,12 @@ main(int argc, char **argv) {
     }
     else if (!strcmp(frontend, "webapp")) {
         #ifdef FRONTEND_HTTPD
+        httpdSetSessionMemory((size_t)sessions << 20);
+        httpdSetThreads(threads);
+        httpdSetMaxConnections(maxConns);
+        if (io && httpdSetBackend(io) < 0)
+            printf("Error: I/O backend %s not built, using epoll\n", io);
+        httpdSetAccessLog(logPath);
         httpdStart(gameGetBoard(), size);
         httpdDestroy();
         #else
@@ -358,6 +417,14 @@ main(int argc, char **argv) {
         printf("Error: Frontend java not built\n");
         #endif
     }
+    else if (!strcmp(frontend, "bot")) {
+        #ifdef FRONTEND_BOTSOCK
+        botsockStart(gameGetBoard(), size);
+        botsockDestroy();
+        #else
+        printf("Error: Frontend bot not built\n");
+        #endif
+    }
     else {
         printf("Error: Frontend not recognised: %s\n", frontend);
         printFrontends();
@@ -365,5 +432,9 @@ main(int argc, char **argv) {
 
     gameDestroy();
 
+    #ifndef _WIN32
+    shmExportDestroy();
+    #endif
+
     return 0;
 }
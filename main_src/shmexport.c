@@ -0,0 +1,79 @@
+/*
+
+    arfminesweeper: Cross-plataform multi-frontend game
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    shmexport.c: Game memory in a POSIX shared memory segment, so external
+        viewers and bots can map the board read-only
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "shmexport.h"
+
+static char shmName[256];
+static void *shmMem = NULL;
+static size_t shmSize = 0;
+
+/* Create (or replace) the segment and map it, NULL on error */
+void *
+shmExportCreate(const char *name, size_t size) {
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        printf("Error opening shared memory %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+
+    if (ftruncate(fd, size) < 0) {
+        printf("Error sizing shared memory: %s\n", strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        printf("Error mapping shared memory: %s\n", strerror(errno));
+        shm_unlink(name);
+        return NULL;
+    }
+
+    strncpy(shmName, name, sizeof(shmName) - 1);
+    shmMem = mem;
+    shmSize = size;
+
+    printf("Exporting board in shared memory %s (%zu bytes)\n", name, size);
+
+    return mem;
+}
+
+void
+shmExportDestroy() {
+    if (shmMem == NULL)
+        return;
+
+    munmap(shmMem, shmSize);
+    shm_unlink(shmName);
+    shmMem = NULL;
+}
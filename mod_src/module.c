@@ -55,6 +55,7 @@ static size_t read_size = 0;
 /* Game stuff */
 static int size = 8;
 static int mines = 10;
+static int safe = 0;
 
 static const int *board = NULL;
 
@@ -63,6 +64,8 @@ module_param(size, int, 0);
 MODULE_PARM_DESC(size, "Board side size");
 module_param(mines, int, 0);
 MODULE_PARM_DESC(mines, "Number of mines");
+module_param(safe, int, 0);
+MODULE_PARM_DESC(safe, "Never lose on the first click");
 
 /* File operations */
 static int
@@ -166,6 +169,7 @@ arfmm_write(struct file *filep, const char *buf, size_t len, loff_t *off) {
     switch (c) {
         case 'c': gameClearCell(x, y); break;
         case 'f': gameFlagCell(x, y); break;
+        case 'm': gameChordCell(x, y); break;
         default: {
             printk(KERN_INFO "arfminesweeper: unknown command\n");
             return -EINVAL;
@@ -225,7 +229,14 @@ arfmm_start(void) {
     }
 
 
-    gameInit(size, mines);
+    gameSetSafeFirstClick(safe);
+    if (gameInit(size, mines) < 0) {
+        device_destroy(arfminesweeper_class, MKDEV(major_number, 0));
+        class_destroy(arfminesweeper_class);
+        unregister_chrdev(major_number, DEVICE_NAME);
+        printk(KERN_ALERT "arfminesweeper: gameInit failed\n");
+        return -EINVAL;
+    }
 
     board = gameGetBoard();
 
@@ -0,0 +1,613 @@
+/*
+
+    arfminesweeper: Cross-plataform multi-frontend game
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    msload.c: Load generator for the webapp. Keep-alive connections replay
+        clicks at a fixed rate, and latency is taken from when each request
+        was due, not when it went out, so a stalled server is not hidden by
+        the requests it kept from being sent (coordinated omission)
+
+*/
+
+#define _GNU_SOURCE     /* memmem */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define RECV_SIZE       16384
+#define MAX_EVENTS      256
+#define DRAIN_NS        2000000000ULL   /* after the run, for ones in flight */
+
+/* Latency histogram in ns: every power of 2 split in HIST_SUB linear
+    buckets, within 1% at any scale up to about 68 s */
+#define HIST_SUB_BITS   7
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_OCTAVES    30
+#define HIST_BUCKETS    (HIST_OCTAVES * HIST_SUB + 1)
+
+typedef struct {
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count, sum, max;
+} hist_t;
+
+/* Response parser states */
+#define RESP_HEAD       0
+#define RESP_BODY       1   /* remaining bytes, then done */
+#define RESP_CHUNK      2   /* a chunk size line */
+#define RESP_CHUNK_DATA 3   /* remaining bytes, then another chunk */
+
+typedef struct {
+    int fd;
+    int busy;               /* a request is in flight */
+    uint64_t due;           /* ns, when the next request is meant to go */
+    uint64_t start;         /* ns, latency of the one in flight counts from */
+    char cookie[64];        /* session, sent back like a browser would */
+    int state, status, closeAfter;
+    uint64_t remaining;
+    char in[RECV_SIZE];
+    size_t inLen;
+} conn_t;
+
+typedef struct {
+    pthread_t thread;
+    int index, nconns;
+    conn_t *conns;
+    uint64_t seed;
+    /* Results */
+    hist_t hist;
+    uint64_t done, errors, behind;
+    uint64_t status[6];     /* by class, 1xx to 5xx, 0 for anything else */
+} worker_t;
+
+/* Options */
+static const char *host = "127.0.0.1";
+static int port = 8080;
+static int nconns = 64, nthreads = 1, duration = 10;
+static double rate = 1000;              /* req/s in all, 0 for closed loop */
+static int weights[3] = { 6, 3, 1 };    /* clear, flag, /flag.png */
+static int size = 0;
+
+static struct sockaddr_in addr;
+static uint64_t startTime, endTime;
+
+static uint64_t
+nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+histIndex(uint64_t v) {
+    if (v < HIST_SUB)
+        return v;
+    int top = 63 - __builtin_clzll(v);
+    int octave = top - HIST_SUB_BITS + 1;
+    if (octave >= HIST_OCTAVES)
+        return HIST_BUCKETS - 1;
+    return octave * HIST_SUB + (int)(v >> (top - HIST_SUB_BITS)) - HIST_SUB;
+}
+
+/* Highest value bucket i holds */
+static uint64_t
+histHigh(int i) {
+    if (i < HIST_SUB)
+        return i;
+    int octave = i / HIST_SUB, sub = i % HIST_SUB;
+    uint64_t width = (uint64_t)1 << (octave - 1);
+    return ((uint64_t)HIST_SUB + sub + 1) * width - 1;
+}
+
+static void
+histRecord(hist_t *h, uint64_t v) {
+    h->buckets[histIndex(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+}
+
+static void
+histMerge(hist_t *to, const hist_t *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        to->buckets[i] += from->buckets[i];
+    to->count += from->count;
+    to->sum += from->sum;
+    if (from->max > to->max) to->max = from->max;
+}
+
+/* Value at or below which a fraction q of them are */
+static uint64_t
+histQuantile(const hist_t *h, double q) {
+    uint64_t want = (uint64_t)(q * h->count + 0.5), seen = 0;
+    if (want == 0) want = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= want)
+            return histHigh(i) < h->max ? histHigh(i) : h->max;
+    }
+    return h->max;
+}
+
+static uint64_t
+randNext(uint64_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static int
+connOpen(conn_t *c) {
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd < 0)
+        return -1;
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    /* Blocking, it is next door */
+    if (connect(c->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK) < 0)
+    {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    c->busy = 0;
+    c->inLen = 0;
+    return 0;
+}
+
+/* Next click: clear or flag a random cell, or the flag image a page with
+    flags on it loads */
+static int
+requestText(worker_t *w, conn_t *c, char *o, size_t len) {
+    int total = weights[0] + weights[1] + weights[2];
+    int pick = randNext(&w->seed) % total;
+    int cell = randNext(&w->seed) % ((uint64_t)size * size);
+    char target[64];
+
+    if (pick < weights[0])
+        snprintf(target, sizeof(target), "/?clear=%d", cell);
+    else if (pick < weights[0] + weights[1])
+        snprintf(target, sizeof(target), "/?flag=%d", cell);
+    else
+        snprintf(target, sizeof(target), "/flag.png");
+
+    return snprintf(o, len, "GET %s HTTP/1.1\r\nHost: %s\r\n%s%s%s\r\n",
+        target, host, c->cookie[0] ? "Cookie: " : "", c->cookie,
+        c->cookie[0] ? "\r\n" : "");
+}
+
+static int
+connSend(worker_t *w, conn_t *c, uint64_t start) {
+    char req[256];
+    int len = requestText(w, c, req, sizeof(req));
+    /* Small enough to always fit the socket buffer of an idle connection */
+    if (send(c->fd, req, len, MSG_NOSIGNAL) != len)
+        return -1;
+    c->busy = 1;
+    c->start = start;
+    c->state = RESP_HEAD;
+    return 0;
+}
+
+/* Value of header name in the block at p, NULL if none */
+static const char *
+headerValue(const char *p, const char *end, const char *name) {
+    size_t n = strlen(name);
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL)
+            break;
+        if ((size_t)(eol - p) > n && p[n] == ':' && !strncasecmp(p, name, n)) {
+            p += n + 1;
+            while (*p == ' ') p++;
+            return p;
+        }
+        p = eol + 1;
+    }
+    return NULL;
+}
+
+/* Status, framing and cookie of a response head ending at end */
+static int
+parseHead(conn_t *c, const char *p, const char *end) {
+    if (end - p < 12 || memcmp(p, "HTTP/1.", 7))
+        return -1;
+    c->status = atoi(p + 9);
+
+    const char *v;
+    c->closeAfter = (v = headerValue(p, end, "Connection")) != NULL &&
+        !strncasecmp(v, "close", 5);
+    if ((v = headerValue(p, end, "Set-Cookie")) != NULL) {
+        size_t n = strcspn(v, ";\r\n");
+        if (n < sizeof(c->cookie)) {
+            memcpy(c->cookie, v, n);
+            c->cookie[n] = '\0';
+        }
+    }
+
+    if ((v = headerValue(p, end, "Transfer-Encoding")) != NULL &&
+        !strncasecmp(v, "chunked", 7))
+            c->state = RESP_CHUNK;
+    else {
+        v = headerValue(p, end, "Content-Length");
+        c->remaining = v ? strtoull(v, NULL, 10) : 0;
+        c->state = RESP_BODY;
+    }
+    return 0;
+}
+
+/* Go through what was received. Returns 1 once the response is complete,
+    0 for more, -1 on garbage */
+static int
+parseResponse(conn_t *c) {
+    size_t off = 0;
+    int r = 0;
+
+    while (r == 0) {
+        char *p = c->in + off, *end = c->in + c->inLen;
+        if (c->state == RESP_HEAD) {
+            char *h = memmem(p, end - p, "\r\n\r\n", 4);
+            if (h == NULL) {
+                if (off == 0 && c->inLen == RECV_SIZE)
+                    r = -1;
+                break;
+            }
+            if (parseHead(c, p, h + 2) < 0)
+                r = -1;
+            off = h + 4 - c->in;
+        }
+        else if (c->state == RESP_CHUNK) {
+            char *eol = memmem(p, end - p, "\r\n", 2);
+            if (eol == NULL)
+                break;
+            uint64_t n = strtoull(p, NULL, 16);
+            off = eol + 2 - c->in;
+            /* The last one is followed by an empty line */
+            c->remaining = n + 2;
+            c->state = n ? RESP_CHUNK_DATA : RESP_BODY;
+        }
+        else {
+            uint64_t take = (uint64_t)(end - p) < c->remaining ?
+                (uint64_t)(end - p) : c->remaining;
+            off += take;
+            c->remaining -= take;
+            if (c->remaining)
+                break;
+            if (c->state == RESP_CHUNK_DATA)
+                c->state = RESP_CHUNK;
+            else
+                r = 1;
+        }
+    }
+
+    memmove(c->in, c->in + off, c->inLen - off);
+    c->inLen -= off;
+    return r;
+}
+
+static void
+connDone(worker_t *w, conn_t *c, uint64_t t) {
+    if (t < endTime + DRAIN_NS) {
+        histRecord(&w->hist, t - c->start);
+        w->done++;
+        w->status[c->status >= 100 && c->status < 600 ?
+            c->status / 100 : 0]++;
+    }
+    c->busy = 0;
+}
+
+/* Drop it and connect again, what was in flight is an error */
+static void
+connReset(worker_t *w, int epfd, conn_t *c) {
+    if (c->busy)
+        w->errors++;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    if (connOpen(c) < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        printf("msload: reconnecting: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+static void
+connRead(worker_t *w, int epfd, conn_t *c) {
+    while (1) {
+        ssize_t r = recv(c->fd, c->in + c->inLen, RECV_SIZE - c->inLen, 0);
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0 || !c->busy) {
+            connReset(w, epfd, c);
+            return;
+        }
+        c->inLen += r;
+
+        int done = parseResponse(c);
+        if (done < 0) {
+            connReset(w, epfd, c);
+            return;
+        }
+        if (done) {
+            connDone(w, c, nowNs());
+            if (c->closeAfter)
+                connReset(w, epfd, c);
+            return;
+        }
+    }
+}
+
+static void *
+workerRun(void *arg) {
+    worker_t *w = arg;
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        printf("msload: epoll: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    /* Each connection gets an even share of the rate, staggered */
+    uint64_t interval = rate > 0 ? (uint64_t)(1e9 * nconns / rate) : 0;
+    for (int i = 0; i < w->nconns; i++) {
+        conn_t *c = &w->conns[i];
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        if (connOpen(c) < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+        {
+            printf("msload: connecting: %s\n", strerror(errno));
+            exit(1);
+        }
+        c->due = startTime + interval *
+            ((uint64_t)w->index + (uint64_t)i * nthreads) / nconns;
+    }
+
+    struct epoll_event evs[MAX_EVENTS];
+    while (1) {
+        uint64_t t = nowNs(), next = UINT64_MAX;
+        int inFlight = 0;
+
+        for (int i = 0; i < w->nconns; i++) {
+            conn_t *c = &w->conns[i];
+            if (c->busy) {
+                inFlight = 1;
+                continue;
+            }
+            if (t >= endTime)
+                continue;
+            if (interval == 0) {
+                /* Closed loop, from when it actually goes */
+                if (connSend(w, c, t) < 0)
+                    connReset(w, epfd, c);
+                inFlight = 1;
+                continue;
+            }
+            if (c->due <= t) {
+                if (connSend(w, c, c->due) < 0)
+                    connReset(w, epfd, c);
+                c->due += interval;
+                inFlight = 1;
+            }
+            else if (c->due < next)
+                next = c->due;
+        }
+        if (t >= endTime && (!inFlight || t >= endTime + DRAIN_NS))
+            break;
+
+        /* Spin once the next one is due within a millisecond */
+        int timeout = 100;
+        if (next != UINT64_MAX)
+            timeout = next - t < 1000000 ? 0 : (next - t) / 1000000;
+        int n = epoll_wait(epfd, evs, MAX_EVENTS, timeout);
+        for (int i = 0; i < n; i++)
+            connRead(w, epfd, evs[i].data.ptr);
+    }
+
+    /* Requests that fell so far behind they were never sent */
+    for (int i = 0; i < w->nconns; i++) {
+        conn_t *c = &w->conns[i];
+        if (c->busy)
+            w->errors++;
+        if (interval && c->due < endTime)
+            w->behind += (endTime - c->due + interval - 1) / interval;
+        close(c->fd);
+    }
+    close(epfd);
+    return NULL;
+}
+
+/* Board size from /api/state, so clicks land on it */
+static int
+boardSize(void) {
+    conn_t c = { 0 };
+    if (connOpen(&c) < 0)
+        return -1;
+    fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL) & ~O_NONBLOCK);
+
+    char req[128];
+    int len = snprintf(req, sizeof(req),
+        "GET /api/state HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+        host);
+    if (send(c.fd, req, len, MSG_NOSIGNAL) != len) {
+        close(c.fd);
+        return -1;
+    }
+
+    /* Size comes before the cells */
+    ssize_t r;
+    while (c.inLen < RECV_SIZE - 1 &&
+        (r = recv(c.fd, c.in + c.inLen, RECV_SIZE - 1 - c.inLen, 0)) > 0)
+    {
+        c.inLen += r;
+        c.in[c.inLen] = '\0';
+        if (strstr(c.in, "\"flagsLeft\""))
+            break;
+    }
+    close(c.fd);
+    c.in[c.inLen] = '\0';
+
+    char *p = strstr(c.in, "\"size\":");
+    return p ? atoi(p + 7) : -1;
+}
+
+static void
+printUsage(const char *self) {
+    printf("Usage: %s [--host|-H address] [--port|-p port]\n"
+        "\t[--connections|-c N] [--threads|-t N] [--rate|-r req/s]\n"
+        "\t[--duration|-d s] [--mix|-m clear:flag:image]\n\n"
+        "\t--host | -H:        Server IPv4 address, default 127.0.0.1\n"
+        "\t--port | -p:        Server port, default 8080\n"
+        "\t--connections | -c: Keep-alive connections, default 64\n"
+        "\t--threads | -t:     Threads to spread them on, default 1\n"
+        "\t--rate | -r:        Requests per second in all, default 1000,\n"
+        "\t                    0 to send as fast as responses come back\n"
+        "\t--duration | -d:    Seconds to run, default 10\n"
+        "\t--mix | -m:         Weights of clears, flags and /flag.png\n"
+        "\t                    requests, default 6:3:1\n", self);
+}
+
+static void
+printLatency(const char *name, uint64_t ns) {
+    if (ns < 1000000)
+        printf("    %-7s %10.1f us\n", name, ns / 1e3);
+    else
+        printf("    %-7s %10.3f ms\n", name, ns / 1e6);
+}
+
+int
+main(int argc, char **argv) {
+    if (argc % 2 == 0) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    for (int i = 1; i < argc; i += 2) {
+        if (!strcmp(argv[i], "--host") || !strcmp(argv[i], "-H"))
+            host = argv[i + 1];
+        else if (!strcmp(argv[i], "--port") || !strcmp(argv[i], "-p"))
+            port = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "--connections") || !strcmp(argv[i], "-c"))
+            nconns = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "--threads") || !strcmp(argv[i], "-t"))
+            nthreads = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "--rate") || !strcmp(argv[i], "-r"))
+            rate = atof(argv[i + 1]);
+        else if (!strcmp(argv[i], "--duration") || !strcmp(argv[i], "-d"))
+            duration = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "--mix") || !strcmp(argv[i], "-m")) {
+            if (sscanf(argv[i + 1], "%d:%d:%d", &weights[0], &weights[1],
+                &weights[2]) != 3)
+                    nconns = 0;
+        }
+        else
+            nconns = 0;
+    }
+    if (nconns < 1 || nthreads < 1 || duration < 1 || rate < 0 ||
+        weights[0] < 0 || weights[1] < 0 || weights[2] < 0 ||
+        weights[0] + weights[1] + weights[2] == 0)
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+    if (nthreads > nconns) nthreads = nconns;
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        printf("msload: bad address %s\n", host);
+        return 1;
+    }
+
+    if ((size = boardSize()) <= 0) {
+        printf("msload: no board at %s:%d\n", host, port);
+        return 1;
+    }
+
+    printf("msload: %d connections on %d threads, ", nconns, nthreads);
+    if (rate > 0) printf("%.0f req/s", rate);
+    else printf("closed loop");
+    printf(" for %d s against %s:%d, board %dx%d\n", duration, host, port,
+        size, size);
+
+    conn_t *conns = calloc(nconns, sizeof(conn_t));
+    worker_t *workers = calloc(nthreads, sizeof(worker_t));
+    if (conns == NULL || workers == NULL) {
+        printf("msload: out of memory\n");
+        return 1;
+    }
+
+    startTime = nowNs() + 100000000;
+    endTime = startTime + (uint64_t)duration * 1000000000;
+    for (int i = 0, first = 0; i < nthreads; i++) {
+        worker_t *w = &workers[i];
+        w->index = i;
+        w->nconns = nconns / nthreads + (i < nconns % nthreads);
+        w->conns = conns + first;
+        w->seed = 0x9e3779b97f4a7c15ULL * (i + 1) ^ (uint64_t)time(NULL);
+        first += w->nconns;
+        if (pthread_create(&w->thread, NULL, workerRun, w) != 0) {
+            printf("msload: starting threads: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+
+    hist_t *all = calloc(1, sizeof(hist_t));
+    uint64_t done = 0, errors = 0, behind = 0, status[6] = { 0 };
+    for (int i = 0; i < nthreads; i++) {
+        worker_t *w = &workers[i];
+        pthread_join(w->thread, NULL);
+        histMerge(all, &w->hist);
+        done += w->done;
+        errors += w->errors;
+        behind += w->behind;
+        for (int j = 0; j < 6; j++)
+            status[j] += w->status[j];
+    }
+
+    printf("  requests   %llu completed, %llu errors, %llu never sent\n",
+        (unsigned long long)done, (unsigned long long)errors,
+        (unsigned long long)behind);
+    printf("  throughput %.1f req/s\n", done / (double)duration);
+    printf("  status     1xx %llu, 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu\n",
+        (unsigned long long)status[1], (unsigned long long)status[2],
+        (unsigned long long)status[3], (unsigned long long)status[4],
+        (unsigned long long)status[5]);
+    if (all->count == 0)
+        return 1;
+
+    printf("  latency    %s\n", rate > 0 ?
+        "from when each request was due" :
+        "from when each request was sent, closed loop, not corrected");
+    printLatency("mean", all->sum / all->count);
+    static const double qs[] = { 0.5, 0.9, 0.99, 0.999, 0.9999 };
+    static const char *qnames[] = { "p50", "p90", "p99", "p99.9", "p99.99" };
+    for (int i = 0; i < 5; i++)
+        printLatency(qnames[i], histQuantile(all, qs[i]));
+    printLatency("max", all->max);
+    return 0;
+}